@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace mio {
+
+// Heap allocations made by the calling thread so far. Counted by a
+// program that replaces operator new (proxy_server does); stays 0
+// otherwise.
+inline uint64_t &heapAllocations() {
+    static thread_local uint64_t count = 0;
+    return count;
+}
+
+// Heap allocations the calling thread made since construction.
+class AllocationScope {
+private:
+    uint64_t start_;
+
+public:
+    AllocationScope() :
+        start_(heapAllocations())
+        {}
+
+    uint64_t count() const {
+        return heapAllocations() - start_;
+    }
+};
+
+} // namespace mio
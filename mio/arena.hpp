@@ -0,0 +1,236 @@
+#pragma once
+
+#include <assert.h>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+namespace mio {
+
+// Size class free lists for objects that live on one reactor, like
+// connections and their sockets. Slots are carved from 2 MiB slabs that
+// are kept until the pool goes away, so after warm-up an accept costs a
+// few pointer pops instead of malloc calls, and the objects of busy
+// connections share few pages. Only the owning thread (the one that made
+// the pool) allocates; a free from another thread, when a helper thread
+// dropped the last reference, goes to a lock-free list that the owner
+// takes back once its own list of that size runs dry. Larger sizes fall
+// back to operator new.
+class ArenaPool {
+public:
+    struct Stats {
+        uint64_t allocations;
+        uint64_t frees;
+        uint64_t remote_frees;
+        uint64_t fallbacks;
+        size_t slabs;
+        size_t huge_slabs;      // backed by explicit huge pages
+        size_t slots_in_use;
+    };
+
+private:
+    static constexpr size_t GRANULE = 64;
+    static constexpr size_t CLASSES = 32;
+    static constexpr size_t SLAB_SIZE = 2 << 20;
+
+    struct Slot {
+        Slot *next;
+    };
+
+    Slot *free_[CLASSES];
+    std::atomic<Slot *> remote_free_[CLASSES];
+    char *cursor_;
+    char *end_;
+    std::vector<void *> slabs_;
+    bool huge_pages_;
+    std::thread::id owner_;
+    Stats stats_;
+    std::atomic<uint64_t> remote_frees_;
+
+    static size_t sizeClass(size_t bytes) {
+        return bytes == 0 ? 0 : (bytes - 1) / GRANULE;
+    }
+
+    // Explicit huge pages if some are reserved (vm.nr_hugepages), else a
+    // transparent huge page hint.
+    void addSlab() {
+        void *slab = MAP_FAILED;
+        if (huge_pages_) {
+            slab = ::mmap(nullptr, SLAB_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (slab != MAP_FAILED) {
+                ++stats_.huge_slabs;
+            }
+        }
+        if (slab == MAP_FAILED) {
+            slab = ::mmap(nullptr, SLAB_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (slab == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            if (huge_pages_) {
+                ::madvise(slab, SLAB_SIZE, MADV_HUGEPAGE);
+            }
+        }
+        slabs_.push_back(slab);
+        ++stats_.slabs;
+        cursor_ = static_cast<char *>(slab);
+        end_ = cursor_ + SLAB_SIZE;
+    }
+
+public:
+    explicit ArenaPool(bool huge_pages = false) :
+        cursor_(nullptr),
+        end_(nullptr),
+        slabs_(),
+        huge_pages_(huge_pages),
+        owner_(std::this_thread::get_id()),
+        stats_(),
+        remote_frees_(0) {
+        for (size_t i = 0; i < CLASSES; ++i) {
+            free_[i] = nullptr;
+            remote_free_[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ArenaPool(const ArenaPool &) = delete;
+    ArenaPool &operator=(const ArenaPool &) = delete;
+
+    ~ArenaPool() {
+        for (void *slab : slabs_) {
+            ::munmap(slab, SLAB_SIZE);
+        }
+    }
+
+    void *allocate(size_t bytes) {
+        assert(std::this_thread::get_id() == owner_);
+        size_t size_class = sizeClass(bytes);
+        if (size_class >= CLASSES) {
+            ++stats_.fallbacks;
+            return ::operator new(bytes);
+        }
+        ++stats_.allocations;
+        ++stats_.slots_in_use;
+        Slot *slot = free_[size_class];
+        if (!slot && remote_free_[size_class].load(std::memory_order_relaxed)) {
+            slot = remote_free_[size_class].exchange(nullptr, std::memory_order_acquire);
+        }
+        if (slot) {
+            free_[size_class] = slot->next;
+            return slot;
+        }
+        size_t slot_size = (size_class + 1) * GRANULE;
+        if (size_t(end_ - cursor_) < slot_size) {
+            addSlab();
+        }
+        void *result = cursor_;
+        cursor_ += slot_size;
+        return result;
+    }
+
+    void deallocate(void *pointer, size_t bytes) {
+        size_t size_class = sizeClass(bytes);
+        if (size_class >= CLASSES) {
+            ::operator delete(pointer);
+            return;
+        }
+        Slot *slot = static_cast<Slot *>(pointer);
+        if (std::this_thread::get_id() == owner_) {
+            ++stats_.frees;
+            --stats_.slots_in_use;
+            slot->next = free_[size_class];
+            free_[size_class] = slot;
+            return;
+        }
+        remote_frees_.fetch_add(1, std::memory_order_relaxed);
+        slot->next = remote_free_[size_class].load(std::memory_order_relaxed);
+        while (!remote_free_[size_class].compare_exchange_weak(slot->next, slot,
+                    std::memory_order_release, std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t allocations() const {
+        return stats_.allocations;
+    }
+
+    // On the owning thread.
+    Stats stats() const {
+        Stats stats = stats_;
+        stats.remote_frees = remote_frees_.load(std::memory_order_relaxed);
+        stats.slots_in_use -= stats.remote_frees;
+        return stats;
+    }
+};
+
+// Standard allocator over an ArenaPool, or operator new without one; each
+// copy keeps the pool alive, so objects may outlive whoever made them.
+template<typename T>
+class ArenaAllocator {
+private:
+    std::shared_ptr<ArenaPool> pool_;
+
+public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(std::shared_ptr<ArenaPool> pool) :
+        pool_(std::move(pool))
+        {}
+
+    // no move: a moved from allocator still has to free what it allocated
+    ArenaAllocator(const ArenaAllocator &other) :
+        pool_(other.pool_)
+        {}
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) :
+        pool_(other.pool())
+        {}
+
+    const std::shared_ptr<ArenaPool> &pool() const {
+        return pool_;
+    }
+
+    T *allocate(size_t count) {
+        if (!pool_) {
+            return static_cast<T *>(::operator new(count * sizeof(T)));
+        }
+        return static_cast<T *>(pool_->allocate(count * sizeof(T)));
+    }
+
+    void deallocate(T *pointer, size_t count) {
+        if (!pool_) {
+            ::operator delete(pointer);
+            return;
+        }
+        pool_->deallocate(pointer, count * sizeof(T));
+    }
+
+    template<typename U>
+    bool operator==(const ArenaAllocator<U> &other) const {
+        return pool_ == other.pool();
+    }
+
+    template<typename U>
+    bool operator!=(const ArenaAllocator<U> &other) const {
+        return pool_ != other.pool();
+    }
+};
+
+// The object and its reference counts in one slot of pool, or make_shared
+// without a pool.
+template<typename T, typename... Args>
+std::shared_ptr<T> allocateShared(const std::shared_ptr<ArenaPool> &pool, Args &&... args) {
+    if (!pool) {
+        return std::make_shared<T>(std::forward<Args>(args)...);
+    }
+    return std::allocate_shared<T>(ArenaAllocator<T>(pool), std::forward<Args>(args)...);
+}
+
+} // namespace mio
@@ -1,14 +1,14 @@
 #pragma once
 
 #include "internet_address.hpp"
+#include "socket_options.hpp"
+#include "unix_address.hpp"
 
 namespace mio {
 
 class ClientSocket : public Socket {
 private:
-    void connectToHost(std::string hostname) {
-        InternetAddress internet_address = InternetAddress::getAddressByHostname(hostname);
-
+    void connectToAddress(const InternetAddress &internet_address) {
         auto c_address = internet_address.getAddress();
         int connect_result = ::connect(fd_, &c_address, sizeof(c_address));
         if (connect_result < 0) {
@@ -19,10 +19,31 @@ private:
     }
 
 public:
-    ClientSocket(std::string hostname) :
+    ClientSocket(std::string hostname, int port = 80) :
+        Socket(true) {
+        connectToAddress(InternetAddress::getAddressByHostname(hostname, port));
+    }
+
+    explicit ClientSocket(const InternetAddress &address) :
         Socket(true) {
-        connectToHost(hostname);
-    }        
+        connectToAddress(address);
+    }
+
+    ClientSocket(const InternetAddress &address, const SocketOptions &options) :
+        Socket(true) {
+        options.applyToConnect(fd_);
+        connectToAddress(address);
+    }
+
+    // A full listen queue fails the connect, like a refused TCP one.
+    explicit ClientSocket(const UnixAddress &address) :
+        Socket(::socket(AF_UNIX, SOCK_STREAM, 0), true) {
+        int connect_result = ::connect(fd_, (const struct sockaddr *) &address.address,
+                address.length);
+        if (connect_result < 0 && errno != EINPROGRESS) {
+            throw std::runtime_error("Failed to connect to address");
+        }
+    }
 }; 
 
 } // namespace mio
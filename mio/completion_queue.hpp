@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "mio.hpp"
+#include "socket.hpp"
+#include "histogram.hpp"
+
+namespace mio {
+
+// Hands closures from helper threads back to the reactor. post() may be
+// called from any thread and never takes a lock: completions are pushed
+// onto an atomic list and the eventfd is only written by the post that
+// finds the list empty. The reactor watches getSocket() and runPending()
+// takes the whole list at once, so every wakeup delivers a batch.
+class CompletionQueue {
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Node {
+        std::function<void()> completion;
+        Clock::time_point posted;
+        Node *next;
+    };
+
+    std::shared_ptr<Socket> event_socket_;
+    std::atomic<Node *> head_;
+
+    // reactor side statistics
+    uint64_t batches_;
+    uint64_t delivered_;
+    size_t largest_batch_;
+    Histogram delay_us_;
+
+public:
+    CompletionQueue() :
+        event_socket_(std::make_shared<Socket>(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))),
+        head_(nullptr),
+        batches_(0),
+        delivered_(0),
+        largest_batch_(0),
+        delay_us_() {
+        if (event_socket_->getDescriptor() < 0) {
+            throw std::runtime_error("Failed to create eventfd");
+        }
+    }
+
+    CompletionQueue(const CompletionQueue &) = delete;
+    CompletionQueue &operator=(const CompletionQueue &) = delete;
+
+    ~CompletionQueue() {
+        Node *node = head_.exchange(nullptr);
+        while (node) {
+            Node *next = node->next;
+            delete node;
+            node = next;
+        }
+    }
+
+    void post(std::function<void()> completion) {
+        Node *node = new Node{ std::move(completion), Clock::now(), nullptr };
+        Node *head = head_.load(std::memory_order_relaxed);
+        do {
+            node->next = head;
+        } while (!head_.compare_exchange_weak(head, node,
+                    std::memory_order_release, std::memory_order_relaxed));
+        if (!head) {
+            uint64_t one = 1;
+            auto result = ::write(event_socket_->getDescriptor(), &one, sizeof(one));
+            (void) result;
+        }
+    }
+
+    void runPending() {
+        // reset the eventfd before taking the list, so that a post racing
+        // with this call leaves it readable
+        uint64_t count;
+        auto result = ::read(event_socket_->getDescriptor(), &count, sizeof(count));
+        (void) result;
+
+        // the list is newest first
+        Node *node = head_.exchange(nullptr, std::memory_order_acquire);
+        Node *oldest = nullptr;
+        size_t batch = 0;
+        while (node) {
+            Node *next = node->next;
+            node->next = oldest;
+            oldest = node;
+            node = next;
+            ++batch;
+        }
+        if (batch == 0) {
+            return;
+        }
+        ++batches_;
+        delivered_ += batch;
+        largest_batch_ = std::max(largest_batch_, batch);
+
+        Clock::time_point now = Clock::now();
+        while (oldest) {
+            std::unique_ptr<Node> current(oldest);
+            oldest = oldest->next;
+            delay_us_.record(std::chrono::duration_cast<std::chrono::microseconds>
+                    (now - current->posted).count());
+            current->completion();
+        }
+    }
+
+    std::shared_ptr<Socket> getSocket() {
+        return event_socket_;
+    }
+
+    uint64_t batches() const {
+        return batches_;
+    }
+
+    uint64_t delivered() const {
+        return delivered_;
+    }
+
+    size_t largestBatch() const {
+        return largest_batch_;
+    }
+
+    // time from post() to the start of the batch that ran it
+    const Histogram &delay() const {
+        return delay_us_;
+    }
+};
+
+class CompletionReader : public Reader {
+private:
+    std::shared_ptr<CompletionQueue> queue_;
+
+public:
+    explicit CompletionReader(std::shared_ptr<CompletionQueue> queue) :
+        queue_(queue)
+        {}
+
+    virtual bool read() {
+        queue_->runPending();
+        return false;
+    }
+};
+
+} // namespace mio
@@ -1,3 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+
 #include "mio.hpp"
 
 namespace mio {
@@ -11,6 +15,18 @@ protected:
     bool need_close_;
     int flags_;
 
+    // bytes one onInput/onOutput call may move before yielding to other
+    // connections, 0 for no limit; set by the IOServer
+    size_t read_budget_;
+    size_t write_budget_;
+    // set when the last call stopped at its budget with work left
+    bool input_pending_;
+    bool output_pending_;
+    bool ready_listed_;
+    bool input_paused_;
+    uint64_t watch_data_;
+    ConnectionHandle handle_;
+
 public:
     Connection(std::shared_ptr<Socket> socket,
             std::shared_ptr<Reader> reader,
@@ -20,7 +36,15 @@ public:
         reader_(reader),
         writer_(writer),
         closer_(closer),
-        need_close_(false)
+        need_close_(false),
+        read_budget_(0),
+        write_budget_(0),
+        input_pending_(false),
+        output_pending_(false),
+        ready_listed_(false),
+        input_paused_(false),
+        watch_data_(0),
+        handle_()
         {}
 
     virtual bool onInput() {
@@ -45,6 +69,17 @@ public:
     virtual void addOutput(Buffer output) = 0;
     virtual void setCloseAfterOutput() {}
 
+    // bytes waiting to be written
+    virtual size_t queuedOutput() const {
+        return 0;
+    }
+
+    // Runs callback once at most mark bytes wait to be written, or when
+    // the connection closes.
+    virtual void notifyDrained(size_t, std::function<void()> callback) {
+        callback();
+    }
+
     virtual bool needClose() {
         return need_close_;
     }
@@ -53,6 +88,54 @@ public:
         return socket_->getDescriptor();
     }
 
+    void setBudgets(size_t read_budget, size_t write_budget) {
+        read_budget_ = read_budget;
+        write_budget_ = write_budget;
+    }
+
+    bool inputPending() const {
+        return input_pending_;
+    }
+
+    bool outputPending() const {
+        return output_pending_;
+    }
+
+    // maintained by the IOServer
+    bool readyListed() const {
+        return ready_listed_;
+    }
+
+    void setReadyListed(bool ready_listed) {
+        ready_listed_ = ready_listed;
+    }
+
+    bool inputPaused() const {
+        return input_paused_;
+    }
+
+    void setInputPaused(bool input_paused) {
+        input_paused_ = input_paused;
+    }
+
+    // what the IOServer finds the connection by in epoll events
+    uint64_t watchData() const {
+        return watch_data_;
+    }
+
+    void setWatchData(uint64_t watch_data) {
+        watch_data_ = watch_data;
+    }
+
+    // how code that must not keep the connection alive refers to it
+    ConnectionHandle handle() const {
+        return handle_;
+    }
+
+    void setHandle(ConnectionHandle handle) {
+        handle_ = handle;
+    }
+
     virtual ~Connection() {
     }
 };
@@ -77,7 +160,14 @@ public:
     }
 
     virtual void onOutput() {
+        size_t written = 0;
+        output_pending_ = false;
         while (!output_queue_.empty()) {
+            if (write_budget_ != 0 && written >= write_budget_) {
+                output_pending_ = true;
+                return;
+            }
+            written += output_queue_.front()->size();
             writer_->write(output_queue_.front());
             output_queue_.pop();
         }
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace mio {
+
+class Connection;
+
+// Names a connection of one reactor without keeping it alive: its slot in
+// the reactor's ConnectionTable and the generation the slot had when the
+// connection got it. Once the connection is closed the slot moves on and
+// old handles find nothing. Handles are plain values, so copying one costs
+// no atomic refcount and a closure holding one can be destroyed on any
+// thread; they are only resolved on the reactor that issued them.
+struct ConnectionHandle {
+    uint32_t slot;
+    uint32_t generation;    // 0 for no connection
+
+    bool operator == (const ConnectionHandle &other) const {
+        return slot == other.slot && generation == other.generation;
+    }
+};
+
+class ConnectionTable {
+private:
+    struct Slot {
+        Connection *connection;
+        uint32_t generation;
+    };
+
+    std::vector<Slot> slots_;
+    std::vector<uint32_t> free_;
+
+public:
+    ConnectionTable() :
+        slots_(),
+        free_()
+        {}
+
+    ConnectionHandle add(Connection *connection) {
+        uint32_t slot;
+        if (free_.empty()) {
+            slot = slots_.size();
+            slots_.push_back({ nullptr, 0 });
+        } else {
+            slot = free_.back();
+            free_.pop_back();
+        }
+        Slot &entry = slots_[slot];
+        entry.connection = connection;
+        if (++entry.generation == 0) {
+            entry.generation = 1;
+        }
+        return { slot, entry.generation };
+    }
+
+    void remove(ConnectionHandle handle) {
+        if (find(handle)) {
+            slots_[handle.slot].connection = nullptr;
+            free_.push_back(handle.slot);
+        }
+    }
+
+    // null once the connection is closed
+    Connection *find(ConnectionHandle handle) const {
+        if (handle.generation == 0 || handle.slot >= slots_.size() ||
+                slots_[handle.slot].generation != handle.generation) {
+            return nullptr;
+        }
+        return slots_[handle.slot].connection;
+    }
+};
+
+} // namespace mio
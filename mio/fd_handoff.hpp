@@ -0,0 +1,147 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "socket.hpp"
+
+namespace mio {
+
+// Passing of listening descriptors between processes over a UNIX socket
+// (SCM_RIGHTS), used for restarts without closing the listen queue.
+
+inline struct sockaddr_un makeUnixAddress(const std::string &path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("UNIX socket path too long");
+    }
+    memcpy(address.sun_path, path.data(), path.size());
+    return address;
+}
+
+// Only the owner of the process (or root) may connect: whoever does gets
+// its listening sockets.
+class HandoffServerSocket : public Socket {
+private:
+    std::string path_;
+
+    static bool trusted(int fd) {
+        struct ucred credentials;
+        socklen_t length = sizeof(credentials);
+        if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == -1) {
+            return false;
+        }
+        return credentials.uid == ::geteuid() || credentials.uid == 0;
+    }
+
+public:
+    explicit HandoffServerSocket(const std::string &path) :
+        Socket(::socket(AF_UNIX, SOCK_STREAM, 0), true),
+        path_(path) {
+        struct sockaddr_un address = makeUnixAddress(path);
+        ::unlink(path.c_str());
+        if (::bind(fd_, (struct sockaddr *) &address, sizeof(address)) == -1) {
+            throw std::runtime_error("Failed to bind handoff socket");
+        }
+        // nobody can connect before listen()
+        if (::chmod(path.c_str(), 0600) == -1) {
+            throw std::runtime_error("Failed to restrict handoff socket");
+        }
+        if (::listen(fd_, 16) == -1) {
+            throw std::runtime_error("Failed to listen on handoff socket");
+        }
+    }
+
+    // accepted peers are blocking, the exchange is a single small message;
+    // peers running as another user are dropped
+    std::shared_ptr<Socket> acceptNewConnection() {
+        while (true) {
+            int new_fd = ::accept(fd_, nullptr, nullptr);
+            if (new_fd == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return std::shared_ptr<Socket>(nullptr);
+                }
+                throw std::runtime_error("Failed to accept handoff socket");
+            }
+            if (trusted(new_fd)) {
+                return std::make_shared<Socket>(new_fd, false);
+            }
+            ::close(new_fd);
+        }
+    }
+};
+
+inline void sendDescriptors(int socket_fd, const std::vector<int> &fds) {
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    char count = static_cast<char>(fds.size());
+    struct iovec iov = { &count, sizeof(count) };
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(header), fds.data(), sizeof(int) * fds.size());
+
+    if (::sendmsg(socket_fd, &message, MSG_NOSIGNAL) == -1) {
+        throw std::runtime_error("Failed to send descriptors");
+    }
+}
+
+// Connects to a running process at path and takes over its listeners.
+// Returns an empty vector if nobody is serving the path.
+inline std::vector<int> receiveDescriptors(const std::string &path) {
+    static constexpr size_t MAX_DESCRIPTORS = 64;
+
+    Socket socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+    struct sockaddr_un address = makeUnixAddress(path);
+    if (::connect(socket.getDescriptor(), (struct sockaddr *) &address, sizeof(address)) == -1) {
+        return std::vector<int>();
+    }
+
+    // the union aligns the buffer for the cmsghdr laid over it
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * MAX_DESCRIPTORS)];
+        struct cmsghdr align;
+    } control;
+    char count = 0;
+    struct iovec iov = { &count, sizeof(count) };
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    if (::recvmsg(socket.getDescriptor(), &message, MSG_CMSG_CLOEXEC) <= 0) {
+        throw std::runtime_error("Failed to receive descriptors");
+    }
+
+    std::vector<int> fds;
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr;
+            header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            size_t received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int *data = (const int *) CMSG_DATA(header);
+            fds.insert(fds.end(), data, data + received);
+        }
+    }
+    return fds;
+}
+
+} // namespace mio
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+namespace mio {
+
+// Log2 buckets, each split into SUB_BUCKETS linear sub-buckets, so that a
+// quantile is off by at most 1/SUB_BUCKETS of its value (HdrHistogram's
+// layout with one significant octal digit). Values below SUB_BUCKETS get
+// a bucket each. Recording is a count-leading-zeros, a shift and an
+// increment.
+class Histogram {
+public:
+    static constexpr size_t SUB_BUCKET_BITS = 3;
+    static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BUCKET_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+private:
+    uint64_t buckets_[BUCKETS];
+    uint64_t count_;
+    uint64_t sum_;
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return value;
+        }
+        size_t shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    // smallest value of the bucket, and how many values it covers
+    static uint64_t bucketStart(size_t bucket, uint64_t &width) {
+        if (bucket < SUB_BUCKETS) {
+            width = 1;
+            return bucket;
+        }
+        size_t shift = bucket / SUB_BUCKETS - 1;
+        width = uint64_t(1) << shift;
+        return (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    }
+
+public:
+    Histogram() :
+        count_(0),
+        sum_(0) {
+        memset(buckets_, 0, sizeof(buckets_));
+    }
+
+    void record(uint64_t value) {
+        ++buckets_[bucketOf(value)];
+        ++count_;
+        sum_ += value;
+    }
+
+    uint64_t count() const {
+        return count_;
+    }
+
+    uint64_t mean() const {
+        return count_ == 0 ? 0 : sum_ / count_;
+    }
+
+    // The given quantile (0..1), interpolated linearly within its bucket.
+    uint64_t quantile(double quantile) const {
+        if (count_ == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(quantile * (count_ - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+            if (seen + buckets_[bucket] >= rank) {
+                uint64_t width;
+                uint64_t start = bucketStart(bucket, width);
+                // the values of the bucket taken as spread evenly over it
+                double within = double(rank - seen) / buckets_[bucket];
+                uint64_t offset = static_cast<uint64_t>(within * width);
+                return start + (offset < width ? offset : width - 1);
+            }
+            seen += buckets_[bucket];
+        }
+        return UINT64_MAX;
+    }
+};
+
+} // namespace mio
@@ -22,20 +22,25 @@ public:
         return InternetAddress(*((sockaddr *) &address));
     } 
     
+    static bool isIP(const std::string &host) {
+        struct in_addr address;
+        return inet_aton(host.c_str(), &address) != 0;
+    }
+
+    // Blocks on DNS for names; safe to call from any thread.
     static InternetAddress getAddressByHostname(std::string hostname, int port = WEB_PORT) {
-        struct sockaddr_in address;
-        address.sin_family = AF_INET;
-        address.sin_port = htons(WEB_PORT);
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
 
-        struct hostent *h = gethostbyname(hostname.c_str());
-        if (!h) {
+        struct addrinfo *result = nullptr;
+        if (getaddrinfo(hostname.c_str(), nullptr, &hints, &result) != 0 || !result) {
             throw std::runtime_error("Failed to get host by name");
         }
-
-        int result = inet_aton(inet_ntoa(*((struct in_addr *)h->h_addr)), &address.sin_addr);
-        if (result <= 0) {
-            throw std::runtime_error("Failed to get ip by host\n");
-        }
+        struct sockaddr_in address = *((struct sockaddr_in *) result->ai_addr);
+        freeaddrinfo(result);
+        address.sin_port = htons(port);
 
         return InternetAddress(*((sockaddr *) &address));
     }
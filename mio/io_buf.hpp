@@ -0,0 +1,361 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "mio.hpp"
+
+namespace mio {
+
+// Reference count policies for IoBuf blocks. Blocks that may be released
+// on another thread (closures handed to the offload pool, say) need the
+// atomic one; chains that never leave their reactor can use the plain one.
+class AtomicRefCount {
+private:
+    std::atomic<uint32_t> count_;
+
+public:
+    AtomicRefCount() :
+        count_(1)
+        {}
+
+    void acquire() {
+        count_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // True when the last reference went away.
+    bool release() {
+        return count_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+    bool unique() const {
+        return count_.load(std::memory_order_acquire) == 1;
+    }
+};
+
+class LocalRefCount {
+private:
+    uint32_t count_;
+
+public:
+    LocalRefCount() :
+        count_(1)
+        {}
+
+    void acquire() {
+        ++count_;
+    }
+
+    bool release() {
+        return --count_ == 0;
+    }
+
+    bool unique() const {
+        return count_ == 1;
+    }
+};
+
+// A byte sequence as a chain of ranges over refcounted blocks. Copying,
+// slicing, splitting and appending one chain to another only adjust
+// reference counts; bytes are copied only by appendCopy() and by
+// toBuffer() when the chain is not already a whole Buffer. A block either
+// holds its bytes right behind its header or adopts a received Buffer, so
+// Buffers enter a chain without a copy. Sent with writev through gather().
+template<typename RefCount>
+class BasicIoBuf {
+private:
+    static constexpr size_t MIN_BLOCK = 256;
+
+    struct Block {
+        RefCount refs;
+        char *data;
+        size_t capacity;
+        size_t used;        // bytes written, the rest is free for appendCopy()
+        Buffer adopted;
+    };
+
+    struct Segment {
+        Block *block;
+        size_t offset;
+        size_t length;
+    };
+
+    std::vector<Segment> segments_;
+    size_t size_;
+    // block appendCopy() fills, with a reference of its own; only the chain
+    // that allocated it writes to it, other chains see its used bytes only
+    Block *writable_;
+
+    static Block *allocate(size_t capacity) {
+        Block *block = new (::operator new(sizeof(Block) + capacity)) Block();
+        block->data = reinterpret_cast<char *>(block + 1);
+        block->capacity = capacity;
+        block->used = 0;
+        return block;
+    }
+
+    static Block *adopt(const Buffer &buffer) {
+        Block *block = new (::operator new(sizeof(Block))) Block();
+        block->data = buffer->data();
+        block->capacity = buffer->size();
+        block->used = buffer->size();
+        block->adopted = buffer;
+        return block;
+    }
+
+    static void release(Block *block) {
+        if (block->refs.release()) {
+            block->~Block();
+            ::operator delete(block);
+        }
+    }
+
+    // Takes over one reference to block.
+    void appendSegment(Block *block, size_t offset, size_t length) {
+        if (!segments_.empty()) {
+            Segment &last = segments_.back();
+            if (last.block == block && last.offset + last.length == offset) {
+                last.length += length;
+                size_ += length;
+                release(block);
+                return;
+            }
+        }
+        Segment segment = { block, offset, length };
+        segments_.push_back(segment);
+        size_ += length;
+    }
+
+    void releaseAll() {
+        for (auto &segment : segments_) {
+            release(segment.block);
+        }
+        segments_.clear();
+        size_ = 0;
+        if (writable_) {
+            release(writable_);
+            writable_ = nullptr;
+        }
+    }
+
+public:
+    BasicIoBuf() :
+        segments_(),
+        size_(0),
+        writable_(nullptr)
+        {}
+
+    explicit BasicIoBuf(const Buffer &buffer) :
+        segments_(),
+        size_(0),
+        writable_(nullptr) {
+        append(buffer);
+    }
+
+    BasicIoBuf(const BasicIoBuf &other) :
+        segments_(other.segments_),
+        size_(other.size_),
+        writable_(nullptr) {
+        for (auto &segment : segments_) {
+            segment.block->refs.acquire();
+        }
+    }
+
+    BasicIoBuf(BasicIoBuf &&other) :
+        segments_(std::move(other.segments_)),
+        size_(other.size_),
+        writable_(other.writable_) {
+        other.segments_.clear();
+        other.size_ = 0;
+        other.writable_ = nullptr;
+    }
+
+    BasicIoBuf &operator=(BasicIoBuf other) {
+        swap(other);
+        return *this;
+    }
+
+    ~BasicIoBuf() {
+        releaseAll();
+    }
+
+    void swap(BasicIoBuf &other) {
+        segments_.swap(other.segments_);
+        std::swap(size_, other.size_);
+        std::swap(writable_, other.writable_);
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    size_t segmentCount() const {
+        return segments_.size();
+    }
+
+    void clear() {
+        releaseAll();
+    }
+
+    void append(const Buffer &buffer) {
+        append(buffer, 0, buffer->size());
+    }
+
+    // References length bytes of buffer from offset; ranges that continue
+    // the previous one extend it.
+    void append(const Buffer &buffer, size_t offset, size_t length) {
+        if (length == 0) {
+            return;
+        }
+        if (!segments_.empty()) {
+            Segment &last = segments_.back();
+            if (last.block->adopted == buffer && last.offset + last.length == offset) {
+                last.length += length;
+                size_ += length;
+                return;
+            }
+        }
+        Segment segment = { adopt(buffer), offset, length };
+        segments_.push_back(segment);
+        size_ += length;
+    }
+
+    void append(const BasicIoBuf &other) {
+        for (auto &segment : other.segments_) {
+            segment.block->refs.acquire();
+            appendSegment(segment.block, segment.offset, segment.length);
+        }
+    }
+
+    void append(BasicIoBuf &&other) {
+        for (auto &segment : other.segments_) {
+            appendSegment(segment.block, segment.offset, segment.length);
+        }
+        other.segments_.clear();
+        other.size_ = 0;
+    }
+
+    // Copies data in. Small copies share one block per chain, so the text
+    // inserted between referenced ranges costs a single allocation.
+    void appendCopy(const char *data, size_t length) {
+        if (length == 0) {
+            return;
+        }
+        if (!writable_ || writable_->capacity - writable_->used < length) {
+            if (writable_) {
+                release(writable_);
+            }
+            writable_ = allocate(length > MIN_BLOCK ? length : MIN_BLOCK);
+        }
+        size_t offset = writable_->used;
+        memcpy(writable_->data + offset, data, length);
+        writable_->used += length;
+        writable_->refs.acquire();
+        appendSegment(writable_, offset, length);
+    }
+
+    void appendCopy(const std::string &data) {
+        appendCopy(data.data(), data.size());
+    }
+
+    // The bytes [offset, offset + length) as a new chain.
+    BasicIoBuf slice(size_t offset, size_t length) const {
+        BasicIoBuf result;
+        for (auto &segment : segments_) {
+            if (length == 0) {
+                break;
+            }
+            if (offset >= segment.length) {
+                offset -= segment.length;
+                continue;
+            }
+            size_t taken = std::min(segment.length - offset, length);
+            segment.block->refs.acquire();
+            result.appendSegment(segment.block, segment.offset + offset, taken);
+            length -= taken;
+            offset = 0;
+        }
+        return result;
+    }
+
+    // Removes the first length bytes and returns them.
+    BasicIoBuf split(size_t length) {
+        BasicIoBuf front;
+        size_t whole = 0;
+        while (whole < segments_.size() && length >= segments_[whole].length) {
+            length -= segments_[whole].length;
+            ++whole;
+        }
+        front.segments_.assign(segments_.begin(), segments_.begin() + whole);
+        segments_.erase(segments_.begin(), segments_.begin() + whole);
+        for (auto &segment : front.segments_) {
+            front.size_ += segment.length;
+        }
+        if (length != 0 && !segments_.empty()) {
+            Segment &first = segments_.front();
+            first.block->refs.acquire();
+            front.appendSegment(first.block, first.offset, length);
+            first.offset += length;
+            first.length -= length;
+        }
+        size_ -= front.size_;
+        return front;
+    }
+
+    // Fills at most max_count entries with the bytes after the first skip.
+    size_t gather(struct iovec *iov, size_t max_count, size_t skip) const {
+        size_t count = 0;
+        for (auto &segment : segments_) {
+            if (count == max_count) {
+                break;
+            }
+            if (skip >= segment.length) {
+                skip -= segment.length;
+                continue;
+            }
+            iov[count].iov_base = segment.block->data + segment.offset + skip;
+            iov[count].iov_len = segment.length - skip;
+            skip = 0;
+            ++count;
+        }
+        return count;
+    }
+
+    // Contiguous bytes: the adopted Buffer itself if the chain is exactly
+    // one whole Buffer, otherwise a copy.
+    Buffer toBuffer() const {
+        if (segments_.size() == 1) {
+            const Segment &segment = segments_.front();
+            const Buffer &adopted = segment.block->adopted;
+            if (adopted && segment.offset == 0 && segment.length == adopted->size()) {
+                return adopted;
+            }
+        }
+        Buffer buffer = createBuffer(size_);
+        size_t offset = 0;
+        for (auto &segment : segments_) {
+            memcpy(buffer->data() + offset, segment.block->data + segment.offset,
+                    segment.length);
+            offset += segment.length;
+        }
+        return buffer;
+    }
+};
+
+typedef BasicIoBuf<AtomicRefCount> IoBuf;
+// for chains that stay on one reactor
+typedef BasicIoBuf<LocalRefCount> LocalIoBuf;
+
+} // namespace mio
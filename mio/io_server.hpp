@@ -10,8 +10,12 @@
 #include <fcntl.h>
 #include <sys/epoll.h>
 #include <errno.h>
+#include <algorithm>
 #include <chrono>
 #include <atomic>
+#include <deque>
+#include <functional>
+#include <vector>
 
 #include "mio.hpp"
 #include "connection.hpp"
@@ -49,9 +53,11 @@ public:
             epoll_socket_(epoll_socket)
             {}
 
+        // A UNIX socket peer that closes after writing raises EPOLLHUP
+        // together with EPOLLIN; the pending bytes are read first.
         bool error() {
             return (event_->events & EPOLLERR ||
-                    event_->events & EPOLLHUP);
+                    (event_->events & EPOLLHUP && !(event_->events & EPOLLIN)));
         }
 
         std::string getErrorMessage(int fd) {
@@ -65,6 +71,11 @@ public:
             }
         }
 
+        // hung up without an error
+        bool hangup() {
+            return (event_->events & EPOLLHUP) && !(event_->events & EPOLLERR);
+        }
+
         bool closed() {
             return (event_->events & EPOLLRDHUP);
         }
@@ -109,11 +120,12 @@ public:
         }
     };
 
-    void getReadyDescriptors() {
-        events_ready_count_ = epoll_wait(epoll_socket_.getDescriptor(), 
+    void getReadyDescriptors(int timeout_ms = -1) {
+        int result = epoll_wait(epoll_socket_.getDescriptor(),
                 events_, 
                 MAX_EVENTS, 
-                -1);
+                timeout_ms);
+        events_ready_count_ = result > 0 ? result : 0;
     }
 
     EpollEventIterator begin() {
@@ -151,62 +163,281 @@ public:
             throw std::runtime_error("Fail to add watched socket");
         }
     }
+
+    // Stops or resumes watching for input; output and hangups still come.
+    void watchInput(int fd, uint64_t data, bool input) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.data.u64 = data;
+        event.events = (input ? uint32_t(EPOLLIN) : 0) | EPOLLOUT | EPOLLRDHUP;
+        epoll_ctl(epoll_socket_.getDescriptor(), EPOLL_CTL_MOD, fd, &event);
+    }
+
+    void removeWatchedDescriptor(int fd) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        epoll_ctl(epoll_socket_.getDescriptor(), EPOLL_CTL_DEL, fd, &event);
+    }
+};
+
+class TimerQueue {
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Timer {
+        Clock::time_point deadline;
+        uint64_t sequence;
+        std::function<void()> callback;
+
+        bool operator > (const Timer &other) const {
+            if (deadline != other.deadline) {
+                return deadline > other.deadline;
+            }
+            return sequence > other.sequence;
+        }
+    };
+
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+    uint64_t sequence_;
+
+public:
+    TimerQueue() :
+        timers_(),
+        sequence_(0)
+        {}
+
+    void add(std::chrono::milliseconds delay, std::function<void()> callback) {
+        Timer timer = { Clock::now() + delay, sequence_++, callback };
+        timers_.push(timer);
+    }
+
+    // Fires every expired timer and returns the epoll timeout until the
+    // next one, -1 if there is none.
+    int runExpired() {
+        auto now = Clock::now();
+        while (!timers_.empty() && timers_.top().deadline <= now) {
+            std::function<void()> callback = timers_.top().callback;
+            timers_.pop();
+            callback();
+        }
+        if (timers_.empty()) {
+            return -1;
+        }
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>
+            (timers_.top().deadline - now).count();
+        return static_cast<int>(wait) + 1;
+    }
 };
 
 template<typename DescriptorManager>
 class IOServer {
 private:
     DescriptorManager socket_manager_;
+    TimerQueue timers_;
 
     std::list<std::shared_ptr<Connection>> connections_;
     typedef std::list<std::shared_ptr<Connection>>::iterator ConnectionIter;
+    std::vector<std::shared_ptr<Connection>> removed_connections_;
+    ConnectionTable handles_;
     std::atomic<bool> stop_;
 
+    // Connections that stopped at their read or write budget with work
+    // left. They are serviced round-robin after every epoll pass, which
+    // does not block while the list is non-empty, and their own epoll
+    // events are ignored until they leave it.
+    std::deque<ConnectionIter> ready_;
+    size_t read_budget_;
+    size_t write_budget_;
+    uint64_t budget_yields_;
+
+    // After an event or a ready list turn: close, or requeue if the
+    // connection still has work left.
+    void finishDispatch(ConnectionIter connection) {
+        if ((*connection)->needClose()) {
+            closeConnection(connection);
+            return;
+        }
+        if ((((*connection)->inputPending() && !(*connection)->inputPaused()) ||
+                    (*connection)->outputPending()) && readyList(connection)) {
+            ++budget_yields_;
+        }
+    }
+
+    // false if it is on the list already
+    bool readyList(ConnectionIter connection) {
+        if ((*connection)->readyListed()) {
+            return false;
+        }
+        (*connection)->setReadyListed(true);
+        ready_.push_back(connection);
+        return true;
+    }
+
+    // Gives one turn to the first count connections on the list; those
+    // queued during this pass wait for the next one.
+    void runReadyList(size_t count) {
+        while (count-- > 0 && !ready_.empty()) {
+            ConnectionIter connection = ready_.front();
+            ready_.pop_front();
+            (*connection)->setReadyListed(false);
+            if ((*connection)->inputPending() && !(*connection)->inputPaused()) {
+                (*connection)->onInput();
+            }
+            if (!(*connection)->needClose() && (*connection)->outputPending()) {
+                (*connection)->onOutput();
+            }
+            finishDispatch(connection);
+        }
+    }
+
+    // The connection's place in connections_, kept in its watch data; 0
+    // once it is closed.
+    static ConnectionIter position(const std::shared_ptr<Connection> &connection) {
+        uint64_t watch_data = connection->watchData();
+        ConnectionIter iter;
+        memcpy(static_cast<void *>(&iter), &watch_data, sizeof(iter));
+        return iter;
+    }
+
+    void closeRemovedConnections() {
+        for (auto &removed : removed_connections_) {
+            // unless an error event closed it in the same batch
+            if (removed->watchData() != 0) {
+                closeConnection(position(removed));
+            }
+        }
+        removed_connections_.clear();
+    }
+
 public:
+    void addTimer(std::chrono::milliseconds delay, std::function<void()> callback) {
+        timers_.add(delay, callback);
+    }
+
     std::shared_ptr<Connection> addConnection(std::shared_ptr<Connection> connection) {
         auto iter = connections_.insert(connections_.begin(), connection);
         assert(sizeof(iter) <= sizeof(uint64_t));
+        uint64_t watch_data = 0;
+        memcpy(&watch_data, static_cast<const void *>(&iter), sizeof(iter));
+        connection->setWatchData(watch_data);
+        connection->setHandle(handles_.add(connection.get()));
+        connection->setBudgets(read_budget_, write_budget_);
         socket_manager_.addWatchedDescriptor(connection->getDescriptor(), iter);
         return connection;
     }
 
+    // Stops reading from the connection while whoever consumes its input
+    // can not keep up, or resumes; input left over from a read cut short
+    // goes first.
+    void pauseInput(std::shared_ptr<Connection> connection, bool paused) {
+        if (connection->inputPaused() == paused) {
+            return;
+        }
+        connection->setInputPaused(paused);
+        socket_manager_.watchInput(connection->getDescriptor(), connection->watchData(), !paused);
+        if (!paused && connection->inputPending() &&
+                std::find(removed_connections_.begin(), removed_connections_.end(),
+                    connection) == removed_connections_.end()) {
+            readyList(position(connection));
+        }
+    }
+
+    // Stops watching the connection right away and closes it once the
+    // current batch of events is handled. The descriptor is detached from
+    // epoll explicitly since it may have been duplicated into another process.
+    void removeConnection(std::shared_ptr<Connection> connection) {
+        socket_manager_.removeWatchedDescriptor(connection->getDescriptor());
+        if (connection->readyListed()) {
+            connection->setReadyListed(false);
+            for (auto iter = ready_.begin(); iter != ready_.end(); ++iter) {
+                if (**iter == connection) {
+                    ready_.erase(iter);
+                    break;
+                }
+            }
+        }
+        removed_connections_.push_back(connection);
+    }
+
+    // The open connection the handle names, null once it has closed.
+    Connection *find(ConnectionHandle handle) const {
+        return handles_.find(handle);
+    }
+
+    size_t connectionCount() const {
+        return connections_.size();
+    }
+
+    void setBudgets(size_t read_budget, size_t write_budget) {
+        read_budget_ = read_budget;
+        write_budget_ = write_budget;
+    }
+
+    uint64_t budgetYields() const {
+        return budget_yields_;
+    }
+
     void closeConnection(ConnectionIter connection) {
         std::shared_ptr<Connection> inner = *connection;
-        (*connection)->onClose();
+        if (inner->readyListed()) {
+            for (auto iter = ready_.begin(); iter != ready_.end(); ++iter) {
+                if (*iter == connection) {
+                    ready_.erase(iter);
+                    break;
+                }
+            }
+        }
+        inner->onClose();
+        inner->setWatchData(0);
+        handles_.remove(inner->handle());
         connections_.erase(connection); 
     }
 
     IOServer() :
         connections_(),
-        stop_(false)
+        removed_connections_(),
+        handles_(),
+        stop_(false),
+        ready_(),
+        read_budget_(0),
+        write_budget_(0),
+        budget_yields_(0)
         {} 
  
     void eventLoop() {
         while (!stop_) { 
-            socket_manager_.getReadyDescriptors();
+            int timeout = timers_.runExpired();
+            size_t carried = ready_.size();
+            socket_manager_.getReadyDescriptors(carried != 0 ? 0 : timeout);
             for (auto event: socket_manager_) {
                 auto connection = event.template getData<ConnectionIter>();
 
-                if (event.error()) {
+                if ((*connection)->inputPaused() && event.hangup()) {
+                    // the rest of the input is read once it is resumed
+                    continue;
+
+                } else if (event.error()) {
                     std::cerr << event.getErrorMessage((*connection)->getDescriptor()) << std::endl;
                     closeConnection(connection);
                     continue;
 
+                } else if ((*connection)->readyListed()) {
+                    continue;
+
                 } else if (event.input()) {
                     (*connection)->onInput();
 
                 } else if (event.output()) {
                     (*connection)->onOutput();
 
-                } else if (event.closed()) {
-                    closeConnection(connection);
-                    continue;
-                }
-                if ((*connection)->needClose()) {
+                } else if (event.closed() && !(*connection)->inputPaused()) {
                     closeConnection(connection);
                     continue;
                 }
+                finishDispatch(connection);
             }
+            runReadyList(carried);
+            closeRemovedConnections();
         }
     }
 
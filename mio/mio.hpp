@@ -4,8 +4,11 @@
 #include <utility>
 #include <list>
 #include <queue>
+#include <chrono>
+#include <functional>
 
 #include "socket.hpp"
+#include "connection_table.hpp"
 
 namespace mio {
 
@@ -42,6 +45,10 @@ class Connection;
 class ConnectionManager {
 public:
     virtual std::shared_ptr<Connection> addConnection(std::shared_ptr<Connection>) = 0;
+    virtual void addTimer(std::chrono::milliseconds delay, std::function<void()> callback) = 0;
+    virtual void removeConnection(std::shared_ptr<Connection>) = 0;
+    virtual void pauseInput(std::shared_ptr<Connection>, bool paused) = 0;
+    virtual Connection *find(ConnectionHandle handle) = 0;
 };
 
 class InputProtocol {
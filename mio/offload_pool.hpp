@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "completion_queue.hpp"
+#include "histogram.hpp"
+
+namespace mio {
+
+// Worker threads for the blocking calls a reactor must not make itself:
+// name resolution, file reads and the like. A job runs on a worker and
+// returns the completion to run on the reactor that submitted it, which
+// gets there through that reactor's CompletionQueue. Jobs still queued
+// when the pool is destroyed are dropped.
+class OffloadPool {
+public:
+    typedef std::function<std::function<void()>()> Job;
+
+    struct Stats {
+        uint64_t submitted;
+        uint64_t completed;
+        size_t queued;
+        size_t max_queued;
+        size_t busy;
+        Histogram wait_us;      // submit to start
+        Histogram run_us;
+    };
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Entry {
+        std::shared_ptr<CompletionQueue> completions;
+        Job job;
+        Clock::time_point submitted;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<Entry> queue_;
+    bool stop_;
+    Stats stats_;
+    std::vector<std::thread> threads_;
+
+    static uint64_t microseconds(Clock::duration duration) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            ready_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+            if (stop_) {
+                return;
+            }
+            Entry entry = std::move(queue_.front());
+            queue_.pop_front();
+            Clock::time_point start = Clock::now();
+            stats_.wait_us.record(microseconds(start - entry.submitted));
+            stats_.queued = queue_.size();
+            ++stats_.busy;
+            lock.unlock();
+
+            std::function<void()> completion = entry.job();
+            if (completion && entry.completions) {
+                entry.completions->post(std::move(completion));
+            }
+            entry.completions.reset();
+
+            lock.lock();
+            --stats_.busy;
+            ++stats_.completed;
+            stats_.run_us.record(microseconds(Clock::now() - start));
+        }
+    }
+
+public:
+    explicit OffloadPool(size_t threads) :
+        mutex_(),
+        ready_(),
+        queue_(),
+        stop_(false),
+        stats_(),
+        threads_() {
+        for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i) {
+            threads_.push_back(std::thread(&OffloadPool::run, this));
+        }
+    }
+
+    OffloadPool(const OffloadPool &) = delete;
+    OffloadPool &operator=(const OffloadPool &) = delete;
+
+    ~OffloadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        ready_.notify_all();
+        for (auto &thread : threads_) {
+            thread.join();
+        }
+    }
+
+    // The completion returned by job, if any, is posted to completions.
+    void submit(std::shared_ptr<CompletionQueue> completions, Job job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Entry entry = { std::move(completions), std::move(job), Clock::now() };
+            queue_.push_back(std::move(entry));
+            ++stats_.submitted;
+            stats_.queued = queue_.size();
+            stats_.max_queued = std::max(stats_.max_queued, stats_.queued);
+        }
+        ready_.notify_one();
+    }
+
+    size_t threads() const {
+        return threads_.size();
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+};
+
+} // namespace mio
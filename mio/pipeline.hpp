@@ -0,0 +1,431 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <utility>
+
+#include "mio.hpp"
+#include "arena.hpp"
+#include "connection.hpp"
+#include "io_buf.hpp"
+#include "traffic_capture.hpp"
+
+namespace mio {
+
+// Statically composed connections. Every stage (reader, protocol, handler,
+// writer) is held by value inside the connection object, so a connection is
+// a single allocation and the hops between stages are plain member calls.
+// Stages are constructed with the socket and the owning connection, the rest
+// of the constructor arguments are forwarded down the chain, e.g.
+//
+//   pipeline::Connection<pipeline::AsyncReader<InputHttpProtocol<Handler>>,
+//                        pipeline::AsyncWriter<OutputBinaryProtocol>>
+//
+// The virtual Reader/Writer/InputProtocol API in mio.hpp stays for plugins.
+//
+// Connections are owned by their IOServer through std::shared_ptr. The
+// per-request references to client connections (fetches, timers, cache
+// lookups) are ConnectionHandles, plain values checked against the
+// reactor's table, so they neither touch an atomic count nor keep a closed
+// connection alive. Buffers stay std::shared_ptr since they do leave the
+// reactor, to the disk cache and capture writer threads; only the partial
+// request chain (LocalIoBuf) uses a plain count.
+namespace pipeline {
+
+// Output produced a piece at a time while it waits in the queue, such as a
+// file read off the reactor. next() returns null while no piece is ready;
+// the writer asks again on the next writable event. A source that failed
+// will never finish, and its connection is closed.
+class OutputSource {
+public:
+    virtual ~OutputSource() {}
+    virtual size_t size() const = 0;
+    virtual Buffer next() = 0;
+    virtual bool failed() const = 0;
+};
+
+// A queued write: a plain buffer, a chain sent with writev, or a source.
+struct Output {
+    Buffer buffer;
+    IoBuf chain;
+    std::shared_ptr<OutputSource> source;
+
+    size_t size() const {
+        return buffer ? buffer->size() : source ? source->size() : chain.size();
+    }
+};
+
+class ConnectionBase : public mio::Connection,
+    public std::enable_shared_from_this<ConnectionBase> {
+protected:
+    typedef std::deque<Output, ArenaAllocator<Output>> OutputQueue;
+
+    std::queue<Output, OutputQueue> output_queue_;
+    size_t queued_bytes_;
+    bool close_after_output_;
+    uint64_t bytes_written_;
+    CaptureTap capture_tap_;
+    size_t drain_mark_;
+    std::function<void()> on_drained_;
+
+    // after output left the queue
+    void checkDrained() {
+        if (on_drained_ && queued_bytes_ <= drain_mark_) {
+            std::function<void()> callback = std::move(on_drained_);
+            on_drained_ = nullptr;
+            callback();
+        }
+    }
+
+public:
+    // the output queue comes from arena if there is one
+    explicit ConnectionBase(std::shared_ptr<Socket> socket,
+            const std::shared_ptr<ArenaPool> &arena = nullptr) :
+        mio::Connection(socket, nullptr, nullptr, nullptr),
+        output_queue_(ArenaAllocator<Output>(arena)),
+        queued_bytes_(0),
+        close_after_output_(false),
+        bytes_written_(0),
+        capture_tap_(),
+        drain_mark_(0),
+        on_drained_()
+        {}
+
+    uint64_t bytesWritten() const {
+        return bytes_written_;
+    }
+
+    virtual void addOutput(Buffer output) {
+        Output item = { output, IoBuf(), nullptr };
+        queued_bytes_ += item.size();
+        output_queue_.push(std::move(item));
+    }
+
+    void addOutput(const IoBuf &output) {
+        Output item = { nullptr, output, nullptr };
+        queued_bytes_ += item.size();
+        output_queue_.push(std::move(item));
+    }
+
+    void addOutput(std::shared_ptr<OutputSource> output) {
+        Output item = { nullptr, IoBuf(), output };
+        queued_bytes_ += item.size();
+        output_queue_.push(std::move(item));
+    }
+
+    virtual void setCloseAfterOutput() {
+        close_after_output_ = true;
+    }
+
+    virtual size_t queuedOutput() const {
+        return queued_bytes_;
+    }
+
+    // A second waiter is chained to the first, at the lower mark.
+    virtual void notifyDrained(size_t mark, std::function<void()> callback) {
+        if (on_drained_) {
+            std::function<void()> first = std::move(on_drained_);
+            on_drained_ = [first, callback]() {
+                first();
+                callback();
+            };
+            drain_mark_ = std::min(drain_mark_, mark);
+        } else {
+            on_drained_ = std::move(callback);
+            drain_mark_ = mark;
+        }
+        checkDrained();
+    }
+
+    virtual void onClose() {
+        drain_mark_ = size_t(-1);
+        checkDrained();
+    }
+};
+
+template<typename Reader, typename Writer>
+class Connection : public ConnectionBase {
+protected:
+    Writer output_;
+    Reader input_;
+
+    // Sends what the source at the front of the queue has ready, counting
+    // it as it goes since a source can take many calls. True once all of
+    // it is sent.
+    bool writeSource(size_t &written) {
+        OutputSource &source = *output_queue_.front().source;
+        size_t budget = write_budget_ == 0 ? 0 : write_budget_ - written;
+        size_t sent = 0;
+        bool done = output_.write(source, budget, sent);
+        written += sent;
+        bytes_written_ += sent;
+        queued_bytes_ -= sent;
+        if (!done) {
+            if (source.failed()) {
+                need_close_ = true;
+            } else if (write_budget_ != 0 && written >= write_budget_) {
+                output_pending_ = true;
+            }
+            checkDrained();
+        }
+        return done;
+    }
+
+public:
+    template<typename... Args>
+    Connection(std::shared_ptr<Socket> socket, Args &&... args) :
+        ConnectionBase(socket),
+        output_(*socket),
+        input_(*socket, *this, std::forward<Args>(args)...)
+        {}
+
+    template<typename... Args>
+    Connection(const std::shared_ptr<ArenaPool> &arena, std::shared_ptr<Socket> socket,
+            Args &&... args) :
+        ConnectionBase(socket, arena),
+        output_(*socket),
+        input_(*socket, *this, std::forward<Args>(args)...)
+        {}
+
+    virtual bool onInput() {
+        bool closed = input_.read(read_budget_, input_pending_, input_paused_);
+        if (closed) {
+            need_close_ = true;
+        }
+        return closed;
+    }
+
+    virtual void onOutput() {
+        size_t written = 0;
+        output_pending_ = false;
+        while (!output_queue_.empty()) {
+            if (write_budget_ != 0 && written >= write_budget_) {
+                output_pending_ = true;
+                return;
+            }
+            if (output_queue_.front().source) {
+                if (!writeSource(written)) {
+                    return;
+                }
+                output_queue_.pop();
+                continue;
+            }
+            if (!output_.write(output_queue_.front())) {
+                // socket is full, the rest waits for the next EPOLLOUT
+                return;
+            }
+            written += output_queue_.front().size();
+            bytes_written_ += output_queue_.front().size();
+            queued_bytes_ -= output_queue_.front().size();
+            output_queue_.pop();
+        }
+        checkDrained();
+        if (close_after_output_) {
+            need_close_ = true;
+        }
+    }
+
+    Reader &input() {
+        return input_;
+    }
+
+    // Records everything read and written from now on.
+    void startCapture(std::shared_ptr<TrafficCapture> capture,
+            CaptureRecordHeader::Side side) {
+        capture_tap_.start(capture, side);
+        input_.setCaptureTap(&capture_tap_);
+        output_.setCaptureTap(&capture_tap_);
+    }
+};
+
+template<typename Protocol>
+class AsyncReader {
+private:
+    Socket &socket_;
+    Protocol protocol_;
+    CaptureTap *capture_tap_;
+    // received into directly and handed to the protocol as it is; kept
+    // for the next call when a recv found nothing
+    Buffer spare_;
+
+    static constexpr size_t BUFFER_SIZE = 4096;
+
+public:
+    template<typename... Args>
+    AsyncReader(Socket &socket, Args &&... args) :
+        socket_(socket),
+        protocol_(std::forward<Args>(args)...),
+        capture_tap_(nullptr),
+        spare_()
+        {}
+
+    void setCaptureTap(CaptureTap *capture_tap) {
+        capture_tap_ = capture_tap;
+    }
+
+    // Reads until EAGAIN, or until budget bytes (0 for no limit) have been
+    // read or the protocol paused the input, in which case exhausted is
+    // set. Returns true on end of stream.
+    bool read(size_t budget, bool &exhausted, const bool &paused) {
+        size_t total = 0;
+        exhausted = false;
+
+        while (true) {
+            if ((budget != 0 && total >= budget) || paused) {
+                exhausted = true;
+                return false;
+            }
+            if (!spare_) {
+                spare_ = createBuffer(BUFFER_SIZE);
+            }
+            auto recv_result = socket_.recv(spare_->data(), spare_->size());
+            if (recv_result > 0) {
+                total += recv_result;
+                if (capture_tap_) {
+                    capture_tap_->input(spare_->data(), recv_result);
+                }
+                Buffer chunk = std::move(spare_);
+                spare_.reset();
+                chunk->resize(recv_result);
+                protocol_.processDataChunk(chunk);
+            } else if (recv_result < 0) {
+                if (-recv_result == EWOULDBLOCK || -recv_result == EAGAIN) {
+                    return false;
+                } else {
+                    throw std::runtime_error("recv failed");
+                }
+            } else {
+                return true;
+            }
+        }
+    }
+
+    Protocol &protocol() {
+        return protocol_;
+    }
+};
+
+template<typename Protocol>
+class AsyncWriter {
+private:
+    Socket &socket_;
+    Protocol protocol_;
+    Buffer buffer_;
+    size_t written_;
+    size_t source_written_;
+    CaptureTap *capture_tap_;
+
+    // the rest of buffer_, false on EAGAIN
+    bool writeRaw() {
+        while (written_ < buffer_->size()) {
+            auto result = socket_.write(buffer_->data() + written_,
+                    buffer_->size() - written_);
+            if (result < 0) {
+                if (result == -EWOULDBLOCK || result == -EAGAIN) {
+                    return false;
+                }
+                throw std::runtime_error("write failed");
+            }
+            if (capture_tap_) {
+                capture_tap_->output(buffer_->data() + written_, result);
+            }
+            written_ += result;
+        }
+        buffer_.reset();
+        written_ = 0;
+        return true;
+    }
+
+public:
+    explicit AsyncWriter(Socket &socket) :
+        socket_(socket),
+        protocol_(),
+        buffer_(),
+        written_(0),
+        source_written_(0),
+        capture_tap_(nullptr)
+        {}
+
+    void setCaptureTap(CaptureTap *capture_tap) {
+        capture_tap_ = capture_tap;
+    }
+
+    bool write(const Output &output) {
+        return output.buffer ? write(output.buffer) : write(output.chain);
+    }
+
+    // Returns true once the whole buffer has been handed to the kernel.
+    // On a partial write the remainder is kept and the same buffer is
+    // expected again on the next call.
+    bool write(const Buffer &buffer) {
+        if (!buffer_) {
+            buffer_ = protocol_.getResponse(buffer);
+            written_ = 0;
+        }
+        return writeRaw();
+    }
+
+    // A source's pieces in order, bypassing the protocol, until budget
+    // bytes (0 for no limit) went out or the next piece is not ready yet.
+    // sent is what this call wrote; true once the whole source is sent.
+    bool write(OutputSource &source, size_t budget, size_t &sent) {
+        sent = 0;
+        while (source_written_ < source.size()) {
+            if (!buffer_) {
+                if (budget != 0 && sent >= budget) {
+                    return false;
+                }
+                buffer_ = source.next();
+                if (!buffer_) {
+                    return false;
+                }
+                written_ = 0;
+            }
+            size_t before = written_;
+            size_t piece = buffer_->size();
+            bool complete = writeRaw();
+            size_t length = (complete ? piece : written_) - before;
+            sent += length;
+            source_written_ += length;
+            if (!complete) {
+                return false;
+            }
+        }
+        source_written_ = 0;
+        return true;
+    }
+
+    // Same contract for a chain, which bypasses the protocol.
+    bool write(const IoBuf &chain) {
+        static constexpr size_t IOV_BATCH = 64;
+        struct iovec iov[IOV_BATCH];
+
+        while (written_ < chain.size()) {
+            size_t count = chain.gather(iov, IOV_BATCH, written_);
+            auto result = socket_.writev(iov, count);
+            if (result < 0) {
+                if (result == -EWOULDBLOCK || result == -EAGAIN) {
+                    return false;
+                }
+                throw std::runtime_error("writev failed");
+            }
+            if (capture_tap_) {
+                size_t captured = 0;
+                for (size_t i = 0; i < count && captured < size_t(result); ++i) {
+                    size_t length = std::min(iov[i].iov_len, size_t(result) - captured);
+                    capture_tap_->output(static_cast<const char *>(iov[i].iov_base), length);
+                    captured += length;
+                }
+            }
+            written_ += result;
+        }
+        written_ = 0;
+        return true;
+    }
+};
+
+} // namespace pipeline
+} // namespace mio
@@ -7,7 +7,10 @@
 #include <string.h>
 
 #include "socket.hpp"
+#include "arena.hpp"
 #include "internet_address.hpp"
+#include "socket_options.hpp"
+#include "unix_address.hpp"
 
 namespace mio {
 
@@ -39,32 +42,62 @@ private:
     }
 
 public:
-    ServerSocket(std::string ip, int port, bool non_blocking = true) :
+    ServerSocket(std::string ip, int port, bool non_blocking = true,
+            const SocketOptions &options = SocketOptions()) :
         Socket(true),
         non_blocking_(non_blocking) {
         setReuseAddress();
+        options.applyToListener(fd_);
         bindToAddress(InternetAddress::getAddressByIP(ip, port));
         listenTo();
     }
 
-    std::shared_ptr<Socket> acceptNewConnection() {
-        struct sockaddr internet_address;
-        memset(&internet_address, 0, sizeof(internet_address));
-        socklen_t length = 0;
+    // A stale socket file left at the path is replaced. The file is not
+    // removed on close, so that listeners handed to a new process keep it.
+    explicit ServerSocket(const UnixAddress &address, bool non_blocking = true) :
+        Socket(::socket(AF_UNIX, SOCK_STREAM, 0), non_blocking),
+        non_blocking_(non_blocking) {
+        if (!address.abstract()) {
+            ::unlink(address.address.sun_path);
+        }
+        if (::bind(fd_, (const struct sockaddr *) &address.address, address.length) == -1) {
+            throw std::runtime_error("Failed to bind socket");
+        }
+        listenTo();
+    }
+
+    // adopts a listening socket inherited from another process
+    explicit ServerSocket(int fd, bool non_blocking = true) :
+        Socket(fd, non_blocking),
+        non_blocking_(non_blocking)
+        {}
+
+    // Peers on a UNIX socket are reported with family AF_UNIX and no
+    // address. The socket object comes from arena if there is one.
+    std::shared_ptr<Socket> acceptNewConnection(struct sockaddr_in *peer_address = nullptr,
+            const std::shared_ptr<ArenaPool> &arena = nullptr) {
+        struct sockaddr_storage peer;
+        memset(&peer, 0, sizeof(peer));
+        socklen_t length = sizeof(peer);
         
-        int new_fd = ::accept(fd_, &internet_address, &length);
+        int new_fd = ::accept(fd_, (struct sockaddr *) &peer, &length);
         if (new_fd == -1) { 
             if (non_blocking_ && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                char *ip_buffer = inet_ntoa(((sockaddr_in *) &internet_address)->sin_addr);
-                ///std::cerr << "Accept from host " << ip_buffer << std::endl;
-
                 return std::shared_ptr<Socket>(nullptr);
             } else {
                 throw std::runtime_error("Failed to accept socket");
             }
         }
 
-        return std::make_shared<Socket>(new_fd, non_blocking_);
+        if (peer_address) {
+            if (peer.ss_family == AF_INET) {
+                memcpy(peer_address, &peer, sizeof(*peer_address));
+            } else {
+                memset(peer_address, 0, sizeof(*peer_address));
+                peer_address->sin_family = peer.ss_family;
+            }
+        }
+        return allocateShared<Socket>(arena, new_fd, non_blocking_);
     }
 };
 
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <initializer_list>
+#include <signal.h>
+#include <sys/signalfd.h>
+
+#include "socket.hpp"
+
+namespace mio {
+
+// Delivers the given signals through a descriptor so that they can be
+// handled by the event loop instead of an async signal handler.
+class SignalSocket : public Socket {
+private:
+    static int createSignalDescriptor(std::initializer_list<int> signals) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        for (int signal : signals) {
+            sigaddset(&mask, signal);
+        }
+        if (sigprocmask(SIG_BLOCK, &mask, nullptr) == -1) {
+            throw std::runtime_error("Failed to block signals");
+        }
+        int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (fd == -1) {
+            throw std::runtime_error("Failed to create signalfd");
+        }
+        return fd;
+    }
+
+public:
+    explicit SignalSocket(std::initializer_list<int> signals) :
+        Socket(createSignalDescriptor(signals))
+        {}
+
+    // Returns the next pending signal number or 0 if there is none.
+    int readSignal() {
+        struct signalfd_siginfo info;
+        auto result = ::read(fd_, &info, sizeof(info));
+        if (result != sizeof(info)) {
+            return 0;
+        }
+        return info.ssi_signo;
+    }
+};
+
+} // namespace mio
@@ -3,6 +3,7 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #include <assert.h>
 
 namespace mio {
@@ -84,6 +85,15 @@ public:
         return result;
     } 
 
+    int writev(const struct iovec *iov, int iov_count) {
+        assert(have_resources_);
+        int result = ::writev(fd_, iov, iov_count);
+        if (result < 0) {
+            result = -errno;
+        }
+        return result;
+    }
+
     // possible rakes :(
     int getDescriptor() const {
         return fd_;
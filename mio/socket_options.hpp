@@ -0,0 +1,161 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+#include <stdio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+// not in older libc headers
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
+namespace mio {
+
+// TCP options for a listener (inherited by the sockets it accepts) or for
+// outgoing connections. Options left at UNSET keep the kernel's default.
+//
+//   nodelay=on              no Nagle delay for small writes
+//   notsent_lowat=16384     writable only below this many unsent bytes
+//   sndbuf=65536 rcvbuf=... fixed buffer sizes instead of autotuning
+//   defer_accept=5          listeners: accept once data arrived (seconds)
+//   fastopen=256            listeners: queue of data-carrying SYNs
+//   fastopen=on             connects: data goes out with the SYN
+//   keepalive=60,10,5       idle seconds, probe interval, probe count
+struct SocketOptions {
+    static constexpr int UNSET = -1;
+
+    int nodelay;
+    int notsent_lowat;
+    int send_buffer;
+    int receive_buffer;
+    int defer_accept;
+    int fastopen;
+    int keepalive_idle;     // 0 turns keepalive off
+    int keepalive_interval;
+    int keepalive_count;
+
+    SocketOptions() :
+        nodelay(UNSET),
+        notsent_lowat(UNSET),
+        send_buffer(UNSET),
+        receive_buffer(UNSET),
+        defer_accept(UNSET),
+        fastopen(UNSET),
+        keepalive_idle(UNSET),
+        keepalive_interval(UNSET),
+        keepalive_count(UNSET)
+        {}
+
+    // Options set in other take precedence.
+    SocketOptions overriddenBy(const SocketOptions &other) const {
+        SocketOptions result = *this;
+        override(result.nodelay, other.nodelay);
+        override(result.notsent_lowat, other.notsent_lowat);
+        override(result.send_buffer, other.send_buffer);
+        override(result.receive_buffer, other.receive_buffer);
+        override(result.defer_accept, other.defer_accept);
+        override(result.fastopen, other.fastopen);
+        override(result.keepalive_idle, other.keepalive_idle);
+        override(result.keepalive_interval, other.keepalive_interval);
+        override(result.keepalive_count, other.keepalive_count);
+        return result;
+    }
+
+    // One "name=value" from the list above.
+    void set(const std::string &option) {
+        size_t equals = option.find('=');
+        if (equals == std::string::npos) {
+            throw std::runtime_error("Socket option needs a value: " + option);
+        }
+        std::string name = option.substr(0, equals);
+        std::string value = option.substr(equals + 1);
+        if (name == "nodelay") {
+            nodelay = parseFlag(value);
+        } else if (name == "notsent_lowat") {
+            notsent_lowat = std::stoi(value);
+        } else if (name == "sndbuf") {
+            send_buffer = std::stoi(value);
+        } else if (name == "rcvbuf") {
+            receive_buffer = std::stoi(value);
+        } else if (name == "defer_accept") {
+            defer_accept = std::stoi(value);
+        } else if (name == "fastopen") {
+            fastopen = value == "on" ? 1 : (value == "off" ? 0 : std::stoi(value));
+        } else if (name == "keepalive") {
+            if (value == "off") {
+                keepalive_idle = 0;
+            } else if (sscanf(value.c_str(), "%d,%d,%d", &keepalive_idle,
+                        &keepalive_interval, &keepalive_count) != 3) {
+                throw std::runtime_error("keepalive needs idle,interval,count");
+            }
+        } else {
+            throw std::runtime_error("Unknown socket option " + name);
+        }
+    }
+
+    // Before listen(): buffer sizes have to be known when the window scale
+    // is negotiated.
+    void applyToListener(int fd) const {
+        applyCommon(fd);
+        apply(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, defer_accept);
+        apply(fd, IPPROTO_TCP, TCP_FASTOPEN, fastopen);
+    }
+
+    // Before connect(). With fastopen the connect returns at once and the
+    // SYN leaves with the first write, carrying its data if the server
+    // gave us a cookie before.
+    void applyToConnect(int fd) const {
+        applyCommon(fd);
+        apply(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, fastopen);
+    }
+
+private:
+    static void override(int &value, int other) {
+        if (other != UNSET) {
+            value = other;
+        }
+    }
+
+    static int parseFlag(const std::string &value) {
+        if (value == "on") {
+            return 1;
+        }
+        if (value == "off") {
+            return 0;
+        }
+        throw std::runtime_error("Expected on or off, got " + value);
+    }
+
+    static void apply(int fd, int level, int name, int value) {
+        if (value == UNSET) {
+            return;
+        }
+        if (::setsockopt(fd, level, name, &value, sizeof(value)) == -1) {
+            throw std::runtime_error("Failed to set socket options");
+        }
+    }
+
+    void applyCommon(int fd) const {
+        apply(fd, IPPROTO_TCP, TCP_NODELAY, nodelay);
+        apply(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, notsent_lowat);
+        apply(fd, SOL_SOCKET, SO_SNDBUF, send_buffer);
+        apply(fd, SOL_SOCKET, SO_RCVBUF, receive_buffer);
+        if (keepalive_idle != UNSET) {
+            apply(fd, SOL_SOCKET, SO_KEEPALIVE, keepalive_idle != 0);
+        }
+        if (keepalive_idle > 0) {
+            apply(fd, IPPROTO_TCP, TCP_KEEPIDLE, keepalive_idle);
+            apply(fd, IPPROTO_TCP, TCP_KEEPINTVL, keepalive_interval);
+            apply(fd, IPPROTO_TCP, TCP_KEEPCNT, keepalive_count);
+        }
+    }
+};
+
+} // namespace mio
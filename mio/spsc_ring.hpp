@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <stdexcept>
+
+namespace mio {
+
+// Bounded single-producer single-consumer queue. Neither side ever blocks:
+// tryPush fails when the ring is full and tryPop when it is empty.
+template<typename T>
+class SpscRing {
+private:
+    static constexpr size_t CACHE_LINE = 64;
+
+    std::vector<T> slots_;
+    size_t mask_;
+
+    // keep the consumer and producer indices on separate cache lines
+    char head_padding_[CACHE_LINE];
+    std::atomic<size_t> head_;
+    char tail_padding_[CACHE_LINE];
+    std::atomic<size_t> tail_;
+
+public:
+    // capacity is rounded up to a power of two
+    explicit SpscRing(size_t capacity) :
+        slots_(),
+        mask_(0),
+        head_(0),
+        tail_(0) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots_.resize(size);
+        mask_ = size - 1;
+    }
+
+    SpscRing(const SpscRing &) = delete;
+    SpscRing &operator=(const SpscRing &) = delete;
+
+    bool tryPush(const T &value) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) > mask_) {
+            return false;
+        }
+        slots_[tail & mask_] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T &value) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = slots_[head & mask_];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+};
+
+} // namespace mio
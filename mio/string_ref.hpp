@@ -0,0 +1,121 @@
+#pragma once
+
+#include <string>
+
+#include <stddef.h>
+#include <string.h>
+
+namespace mio {
+
+// A view of bytes owned by someone else, for parsing without copies.
+class StringRef {
+private:
+    const char *data_;
+    size_t size_;
+
+    static char lower(char c) {
+        return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+
+public:
+    static constexpr size_t npos = size_t(-1);
+
+    StringRef() :
+        data_(nullptr),
+        size_(0)
+        {}
+
+    StringRef(const char *data, size_t size) :
+        data_(data),
+        size_(size)
+        {}
+
+    StringRef(const std::string &string) :
+        data_(string.data()),
+        size_(string.size())
+        {}
+
+    const char *data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    char operator[](size_t index) const {
+        return data_[index];
+    }
+
+    StringRef substr(size_t position, size_t length = npos) const {
+        if (position > size_) {
+            position = size_;
+        }
+        return StringRef(data_ + position, length < size_ - position ? length : size_ - position);
+    }
+
+    size_t find(char c, size_t position = 0) const {
+        for (size_t i = position; i < size_; ++i) {
+            if (data_[i] == c) {
+                return i;
+            }
+        }
+        return npos;
+    }
+
+    // last c at or before position
+    size_t rfind(char c, size_t position = npos) const {
+        if (size_ == 0) {
+            return npos;
+        }
+        for (size_t i = position < size_ ? position + 1 : size_; i-- > 0; ) {
+            if (data_[i] == c) {
+                return i;
+            }
+        }
+        return npos;
+    }
+
+    bool startsWith(StringRef prefix) const {
+        return prefix.size_ <= size_ && memcmp(data_, prefix.data_, prefix.size_) == 0;
+    }
+
+    bool operator==(StringRef other) const {
+        return size_ == other.size_ && memcmp(data_, other.data_, size_) == 0;
+    }
+
+    // ASCII case-insensitive ordering, for host names
+    int compareIgnoreCase(StringRef other) const {
+        size_t common = size_ < other.size_ ? size_ : other.size_;
+        for (size_t i = 0; i < common; ++i) {
+            char a = lower(data_[i]);
+            char b = lower(other.data_[i]);
+            if (a != b) {
+                return a < b ? -1 : 1;
+            }
+        }
+        return size_ == other.size_ ? 0 : (size_ < other.size_ ? -1 : 1);
+    }
+
+    bool equalsIgnoreCase(StringRef other) const {
+        return size_ == other.size_ && compareIgnoreCase(other) == 0;
+    }
+
+    std::string str() const {
+        return std::string(data_, size_);
+    }
+
+    std::string lowercase() const {
+        std::string result(data_, size_);
+        for (auto &c : result) {
+            c = lower(c);
+        }
+        return result;
+    }
+};
+
+} // namespace mio
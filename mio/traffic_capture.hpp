@@ -0,0 +1,238 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace mio {
+
+// Capture file: a CaptureFileHeader followed by CaptureRecordHeaders, each
+// followed by length bytes of payload. Timestamps are microseconds since
+// the capture started.
+struct CaptureFileHeader {
+    static constexpr char MAGIC[8] = { 'M', 'I', 'O', 'C', 'A', 'P', '0', '1' };
+
+    char magic[8];
+};
+
+constexpr char CaptureFileHeader::MAGIC[8];
+
+struct CaptureRecordHeader {
+    enum Kind : uint8_t {
+        OPEN = 1,       // payload is one byte: the side
+        DATA_IN = 2,    // bytes read from the socket
+        DATA_OUT = 3,   // bytes written to the socket
+        CLOSE = 4,
+        DROP = 5        // records of the connection were dropped before this
+    };
+
+    enum Side : uint8_t {
+        CLIENT = 1,     // accepted from a client
+        UPSTREAM = 2    // opened to an upstream server
+    };
+
+    uint64_t timestamp_us;
+    uint32_t connection;
+    uint8_t kind;
+    uint8_t reserved[3];
+    uint32_t length;
+    uint32_t reserved2;
+};
+
+static_assert(sizeof(CaptureRecordHeader) == 24, "capture record header layout");
+
+// Records the byte streams of connections to a file. Records are appended
+// to an in-memory batch under a short lock and written out by a helper
+// thread; when the writer falls behind by more than max_pending bytes new
+// records are dropped rather than blocking the reactor. Each connection
+// that lost a record gets a DROP record once the writer catches up, so a
+// replay can leave out the streams with holes.
+class TrafficCapture {
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    int fd_;
+    Clock::time_point start_;
+    size_t max_pending_;
+    std::atomic<uint32_t> next_connection_;
+    std::atomic<uint64_t> dropped_;
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::vector<char> pending_;
+    std::unordered_set<uint32_t> lost_;
+    bool stop_;
+    std::thread thread_;
+
+    void writeAll(const char *data, size_t size) {
+        while (size > 0) {
+            ssize_t result = ::write(fd_, data, size);
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            data += result;
+            size -= result;
+        }
+    }
+
+    CaptureRecordHeader makeHeader(uint32_t connection, CaptureRecordHeader::Kind kind,
+            size_t length) const {
+        CaptureRecordHeader header;
+        memset(&header, 0, sizeof(header));
+        header.timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>
+            (Clock::now() - start_).count();
+        header.connection = connection;
+        header.kind = kind;
+        header.length = length;
+        return header;
+    }
+
+    void run() {
+        std::vector<char> batch;
+        std::unordered_set<uint32_t> lost;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this]() {
+                    return stop_ || !pending_.empty() || !lost_.empty();
+                });
+                if (pending_.empty() && lost_.empty() && stop_) {
+                    return;
+                }
+                batch.swap(pending_);
+                lost.swap(lost_);
+            }
+            // after the batch: the lost records came later than all of it
+            for (uint32_t connection : lost) {
+                CaptureRecordHeader header = makeHeader(connection, CaptureRecordHeader::DROP, 0);
+                const char *raw = reinterpret_cast<const char *>(&header);
+                batch.insert(batch.end(), raw, raw + sizeof(header));
+            }
+            writeAll(batch.data(), batch.size());
+            batch.clear();
+            lost.clear();
+        }
+    }
+
+public:
+    explicit TrafficCapture(const std::string &path, size_t max_pending = 64 << 20) :
+        fd_(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)),
+        start_(Clock::now()),
+        max_pending_(max_pending),
+        next_connection_(1),
+        dropped_(0),
+        mutex_(),
+        ready_(),
+        pending_(),
+        lost_(),
+        stop_(false),
+        thread_() {
+        if (fd_ == -1) {
+            throw std::runtime_error("Failed to open capture file " + path);
+        }
+        CaptureFileHeader header;
+        memcpy(header.magic, CaptureFileHeader::MAGIC, sizeof(header.magic));
+        writeAll(header.magic, sizeof(header.magic));
+        thread_ = std::thread(&TrafficCapture::run, this);
+    }
+
+    TrafficCapture(const TrafficCapture &) = delete;
+    TrafficCapture &operator=(const TrafficCapture &) = delete;
+
+    ~TrafficCapture() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        ready_.notify_one();
+        thread_.join();
+        ::close(fd_);
+    }
+
+    uint32_t open(CaptureRecordHeader::Side side) {
+        uint32_t connection = next_connection_++;
+        char payload = side;
+        record(connection, CaptureRecordHeader::OPEN, &payload, 1);
+        return connection;
+    }
+
+    void record(uint32_t connection, CaptureRecordHeader::Kind kind,
+            const char *data, size_t length) {
+        CaptureRecordHeader header = makeHeader(connection, kind, length);
+
+        bool was_empty;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            was_empty = pending_.empty() && lost_.empty();
+            if (pending_.size() + sizeof(header) + length > max_pending_) {
+                ++dropped_;
+                lost_.insert(connection);
+            } else {
+                const char *raw = reinterpret_cast<const char *>(&header);
+                pending_.insert(pending_.end(), raw, raw + sizeof(header));
+                pending_.insert(pending_.end(), data, data + length);
+            }
+        }
+        if (was_empty) {
+            ready_.notify_one();
+        }
+    }
+
+    uint64_t dropped() const {
+        return dropped_;
+    }
+};
+
+// One captured connection, held by the connection; null capture when off.
+// The stream is closed when the connection object goes away.
+class CaptureTap {
+private:
+    std::shared_ptr<TrafficCapture> capture_;
+    uint32_t connection_;
+
+public:
+    CaptureTap() :
+        capture_(),
+        connection_(0)
+        {}
+
+    CaptureTap(const CaptureTap &) = delete;
+    CaptureTap &operator=(const CaptureTap &) = delete;
+
+    ~CaptureTap() {
+        if (capture_) {
+            capture_->record(connection_, CaptureRecordHeader::CLOSE, nullptr, 0);
+        }
+    }
+
+    void start(std::shared_ptr<TrafficCapture> capture, CaptureRecordHeader::Side side) {
+        capture_ = capture;
+        connection_ = capture->open(side);
+    }
+
+    void input(const char *data, size_t length) {
+        capture_->record(connection_, CaptureRecordHeader::DATA_IN, data, length);
+    }
+
+    void output(const char *data, size_t length) {
+        capture_->record(connection_, CaptureRecordHeader::DATA_OUT, data, length);
+    }
+};
+
+} // namespace mio
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdexcept>
+#include <string>
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace mio {
+
+// A UNIX domain socket address, written "unix:/run/app.sock" for a path
+// or "unix:@name" for a name in Linux's abstract namespace, which needs no
+// file and goes away with the last socket bound to it.
+struct UnixAddress {
+    struct sockaddr_un address;
+    socklen_t length;
+
+    explicit UnixAddress(const std::string &path) :
+        length(0) {
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Bad UNIX socket path " + path);
+        }
+        // the abstract name is the bytes after a leading NUL, not terminated
+        memcpy(address.sun_path, path.data(), path.size());
+        if (path[0] == '@') {
+            address.sun_path[0] = '\0';
+            length = offsetof(struct sockaddr_un, sun_path) + path.size();
+        } else {
+            length = sizeof(address);
+        }
+    }
+
+    bool abstract() const {
+        return address.sun_path[0] == '\0';
+    }
+
+    static bool isUnixAddress(const std::string &address) {
+        return address.compare(0, 5, "unix:") == 0;
+    }
+
+    // from "unix:<path>"
+    static UnixAddress parse(const std::string &address) {
+        return UnixAddress(address.substr(5));
+    }
+};
+
+} // namespace mio
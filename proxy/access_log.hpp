@@ -0,0 +1,259 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mio/spsc_ring.hpp"
+
+namespace mioproxy {
+
+// Fixed layout record, written to disk as is. tools/access_log_dump turns
+// a log file back into text.
+struct AccessLogRecord {
+    static constexpr size_t HOST_SIZE = 64;
+
+    uint64_t timestamp_us;      // wall clock, request header received
+    uint32_t total_us;          // header received .. last response byte written
+    uint32_t upstream_us;       // upstream connect .. upstream closed
+    uint64_t bytes_sent;        // response bytes written to the client
+    uint32_t client_ip;         // network byte order
+    uint16_t client_port;       // host byte order
+    uint16_t status;
+    uint16_t upstream_port;
+    uint16_t flags;
+    uint32_t reserved;
+    char host[HOST_SIZE];
+    char upstream[HOST_SIZE];
+
+    // response came from a fetch shared with other clients
+    static constexpr uint16_t COALESCED = 1;
+    // response came from the disk cache
+    static constexpr uint16_t CACHED = 2;
+
+    static void copyString(char *target, const std::string &source) {
+        size_t length = std::min(source.size(), HOST_SIZE - 1);
+        memcpy(target, source.data(), length);
+        memset(target + length, 0, HOST_SIZE - length);
+    }
+};
+
+static_assert(sizeof(AccessLogRecord) == 168, "access log record layout changed");
+
+struct AccessLogFileHeader {
+    static constexpr char MAGIC[8] = { 'M', 'I', 'O', 'A', 'L', 'O', 'G', '1' };
+
+    char magic[8];
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+constexpr char AccessLogFileHeader::MAGIC[8];
+
+// The producer side, one per reactor. Never blocks: when the writer falls
+// behind records are counted as dropped.
+class AccessLogRing {
+private:
+    mio::SpscRing<AccessLogRecord> ring_;
+    std::atomic<uint64_t> dropped_;
+
+public:
+    explicit AccessLogRing(size_t capacity) :
+        ring_(capacity),
+        dropped_(0)
+        {}
+
+    void push(const AccessLogRecord &record) {
+        if (!ring_.tryPush(record)) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    bool pop(AccessLogRecord &record) {
+        return ring_.tryPop(record);
+    }
+
+    uint64_t dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+};
+
+// Background thread that drains every reactor's ring into the log file with
+// large writes and rotates the file once it reaches max_bytes. Records
+// lost to a failed write are counted like the ones a full ring drops.
+class AccessLogWriter {
+private:
+    static constexpr size_t BATCH_RECORDS = 1024;
+    static constexpr int IDLE_SLEEP_MS = 20;
+
+    std::string path_;
+    size_t max_bytes_;
+    size_t ring_capacity_;
+    int fd_;
+    size_t file_size_;
+    std::atomic<uint64_t> failed_;
+
+    std::mutex rings_mutex_;
+    std::vector<std::shared_ptr<AccessLogRing>> rings_;
+
+    std::atomic<bool> stop_;
+    std::thread thread_;
+
+    void openFile() {
+        fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd_ == -1) {
+            throw std::runtime_error("Failed to open access log " + path_);
+        }
+        off_t size = ::lseek(fd_, 0, SEEK_END);
+        file_size_ = size > 0 ? size : 0;
+        if (file_size_ == 0) {
+            AccessLogFileHeader header;
+            memcpy(header.magic, AccessLogFileHeader::MAGIC, sizeof(header.magic));
+            header.record_size = sizeof(AccessLogRecord);
+            header.reserved = 0;
+            writeAll((const char *) &header, sizeof(header));
+        }
+    }
+
+    // Renamed to path.<seconds>, or path.<seconds>.<n> for the next
+    // rotations within the same second; link() never replaces an older
+    // file of the same name, which rename() would.
+    void rotate() {
+        ::close(fd_);
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        std::string base = path_ + "." + std::to_string(
+                std::chrono::duration_cast<std::chrono::seconds>(now).count());
+        for (unsigned sequence = 0; ; ++sequence) {
+            std::string rotated = sequence == 0 ? base : base + "." + std::to_string(sequence);
+            if (::link(path_.c_str(), rotated.c_str()) == 0) {
+                ::unlink(path_.c_str());
+                break;
+            }
+            // otherwise keep appending to the current file
+            if (errno != EEXIST) {
+                break;
+            }
+        }
+        openFile();
+    }
+
+    bool writeAll(const char *data, size_t size) {
+        while (size > 0) {
+            ssize_t result = ::write(fd_, data, size);
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += result;
+            size -= result;
+            file_size_ += result;
+        }
+        return true;
+    }
+
+    size_t drain(std::vector<AccessLogRecord> &batch) {
+        std::vector<std::shared_ptr<AccessLogRing>> rings;
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex_);
+            rings = rings_;
+        }
+
+        size_t written = 0;
+        for (auto &ring : rings) {
+            while (true) {
+                batch.clear();
+                AccessLogRecord record;
+                while (batch.size() < BATCH_RECORDS && ring->pop(record)) {
+                    batch.push_back(record);
+                }
+                if (batch.empty()) {
+                    break;
+                }
+                if (max_bytes_ != 0 && file_size_ >= max_bytes_) {
+                    rotate();
+                }
+                size_t start = file_size_;
+                if (!writeAll((const char *) batch.data(), batch.size() * sizeof(AccessLogRecord))) {
+                    // cut off a partial record, so that the rest of the file
+                    // still parses
+                    if (::ftruncate(fd_, start) == 0) {
+                        file_size_ = start;
+                    }
+                    failed_.fetch_add(batch.size(), std::memory_order_relaxed);
+                }
+                written += batch.size();
+            }
+        }
+        return written;
+    }
+
+    void run() {
+        std::vector<AccessLogRecord> batch;
+        batch.reserve(BATCH_RECORDS);
+        while (!stop_.load(std::memory_order_acquire)) {
+            if (drain(batch) == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_SLEEP_MS));
+            }
+        }
+        drain(batch);
+    }
+
+public:
+    AccessLogWriter(const std::string &path, size_t max_bytes, size_t ring_capacity) :
+        path_(path),
+        max_bytes_(max_bytes),
+        ring_capacity_(ring_capacity),
+        fd_(-1),
+        file_size_(0),
+        failed_(0),
+        rings_mutex_(),
+        rings_(),
+        stop_(false),
+        thread_() {
+        openFile();
+        thread_ = std::thread(&AccessLogWriter::run, this);
+    }
+
+    AccessLogWriter(const AccessLogWriter &) = delete;
+    AccessLogWriter &operator=(const AccessLogWriter &) = delete;
+
+    ~AccessLogWriter() {
+        stop_.store(true, std::memory_order_release);
+        thread_.join();
+        ::close(fd_);
+    }
+
+    std::shared_ptr<AccessLogRing> addRing() {
+        auto ring = std::make_shared<AccessLogRing>(ring_capacity_);
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        rings_.push_back(ring);
+        return ring;
+    }
+
+    uint64_t dropped() {
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        uint64_t dropped = 0;
+        for (auto &ring : rings_) {
+            dropped += ring->dropped();
+        }
+        return dropped;
+    }
+
+    uint64_t failed() const {
+        return failed_.load(std::memory_order_relaxed);
+    }
+};
+
+} // namespace mioproxy
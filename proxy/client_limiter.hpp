@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <time.h>
+
+namespace mioproxy {
+
+// Limits applied to every source address inside a CIDR block. With a prefix
+// shorter than /32 the whole block shares one bucket.
+struct ClientLimitRule {
+    uint32_t network;       // host byte order
+    uint32_t prefix_length;
+    double requests_per_second;     // 0 means unlimited
+    double burst;
+    uint32_t max_connections;       // 0 means unlimited
+
+    bool matches(uint32_t ip) const {
+        return (ip & mask()) == network;
+    }
+
+    uint32_t mask() const {
+        return prefix_length == 0 ? 0 : ~uint32_t(0) << (32 - prefix_length);
+    }
+
+    // "10.0.0.0/8 requests_per_second burst max_connections"
+    static ClientLimitRule parse(const std::string &cidr,
+            double requests_per_second, double burst, uint32_t max_connections) {
+        ClientLimitRule rule;
+        size_t slash = cidr.find('/');
+        std::string address = cidr.substr(0, slash);
+        rule.prefix_length = slash == std::string::npos ? 32 : std::stoul(cidr.substr(slash + 1));
+        struct in_addr parsed;
+        if (inet_aton(address.c_str(), &parsed) == 0 || rule.prefix_length > 32) {
+            throw std::runtime_error("Bad client_limit network " + cidr);
+        }
+        rule.network = ntohl(parsed.s_addr) & rule.mask();
+        rule.requests_per_second = requests_per_second;
+        rule.burst = std::max(burst, 1.0);
+        rule.max_connections = max_connections;
+        return rule;
+    }
+};
+
+// Open addressing table of per-client token buckets and connection counts.
+// Only TCP clients are limited: the peers of a UNIX listener are local
+// frontends that carry many users and have no address to tell them apart.
+// Allocated once, probes are bounded and buckets are refilled lazily on
+// lookup, so the accept and request paths never allocate. Entries that hold
+// no connection and whose bucket has refilled are indistinguishable from
+// new ones and get reused by other keys. One table per reactor.
+class ClientLimiter {
+public:
+    // identifies the bucket a client was charged to, 0 if none
+    typedef uint64_t Key;
+
+private:
+    static constexpr size_t MAX_PROBES = 16;
+
+    // Keeps the rate and burst of the rule it is charged under, so that
+    // whether it can be reused does not depend on who is looking.
+    struct Entry {
+        Key key;
+        float tokens;
+        uint32_t refill_ms;
+        uint32_t connections;
+        float requests_per_second;
+        float burst;
+    };
+
+    std::vector<Entry> entries_;
+    size_t mask_;
+    uint64_t rejected_connections_;
+    uint64_t rejected_requests_;
+
+    static uint32_t nowMilliseconds() {
+        struct timespec time;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &time);
+        return uint32_t(time.tv_sec * 1000 + time.tv_nsec / 1000000);
+    }
+
+    static Key makeKey(uint32_t ip, const ClientLimitRule &rule) {
+        return (uint64_t(rule.prefix_length + 1) << 32) | (ip & rule.mask());
+    }
+
+    static size_t hash(Key key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+    // with the rule's current values, which a reload may have changed
+    void refill(Entry &entry, const ClientLimitRule &rule, uint32_t now) const {
+        float elapsed = (now - entry.refill_ms) / 1000.0f;
+        entry.requests_per_second = rule.requests_per_second;
+        entry.burst = rule.burst;
+        entry.tokens = std::min<float>(entry.burst,
+                entry.tokens + elapsed * entry.requests_per_second);
+        entry.refill_ms = now;
+    }
+
+    static bool idle(const Entry &entry, uint32_t now) {
+        if (entry.connections != 0) {
+            return false;
+        }
+        return entry.requests_per_second == 0 ||
+            entry.tokens + (now - entry.refill_ms) / 1000.0f * entry.requests_per_second >= entry.burst;
+    }
+
+    // Returns null when the probe window is full of active clients; the
+    // caller then lets the client through rather than failing closed.
+    Entry *find(Key key, const ClientLimitRule &rule, uint32_t now) {
+        Entry *reusable = nullptr;
+        size_t index = hash(key);
+        for (size_t probe = 0; probe < MAX_PROBES; ++probe, ++index) {
+            Entry &entry = entries_[index & mask_];
+            if (entry.key == key) {
+                refill(entry, rule, now);
+                return &entry;
+            }
+            if (entry.key == 0) {
+                if (!reusable) {
+                    reusable = &entry;
+                }
+                break;
+            }
+            if (!reusable && idle(entry, now)) {
+                reusable = &entry;
+            }
+        }
+        if (reusable) {
+            reusable->key = key;
+            reusable->tokens = rule.burst;
+            reusable->refill_ms = now;
+            reusable->connections = 0;
+            reusable->requests_per_second = rule.requests_per_second;
+            reusable->burst = rule.burst;
+        }
+        return reusable;
+    }
+
+    static const ClientLimitRule *findRule(const std::vector<ClientLimitRule> &rules,
+            uint32_t ip) {
+        // rules are kept sorted by descending prefix length
+        for (auto &rule : rules) {
+            if (rule.matches(ip)) {
+                return &rule;
+            }
+        }
+        return nullptr;
+    }
+
+public:
+    // capacity is rounded up to a power of two
+    explicit ClientLimiter(size_t capacity) :
+        entries_(),
+        mask_(0),
+        rejected_connections_(0),
+        rejected_requests_(0) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        entries_.resize(size, Entry());
+        mask_ = size - 1;
+    }
+
+    static void sortRules(std::vector<ClientLimitRule> &rules) {
+        std::stable_sort(rules.begin(), rules.end(),
+                [](const ClientLimitRule &left, const ClientLimitRule &right) {
+            return left.prefix_length > right.prefix_length;
+        });
+    }
+
+    // Called on accept. Returns false if the client is over its connection
+    // cap, otherwise stores the key to pass to releaseConnection.
+    bool acquireConnection(const std::vector<ClientLimitRule> &rules,
+            const struct sockaddr_in &peer, Key &key) {
+        key = 0;
+        if (peer.sin_family != AF_INET) {
+            return true;
+        }
+        uint32_t ip = ntohl(peer.sin_addr.s_addr);
+        const ClientLimitRule *rule = findRule(rules, ip);
+        if (!rule) {
+            return true;
+        }
+        Entry *entry = find(makeKey(ip, *rule), *rule, nowMilliseconds());
+        if (!entry) {
+            return true;
+        }
+        if (rule->max_connections != 0 && entry->connections >= rule->max_connections) {
+            ++rejected_connections_;
+            return false;
+        }
+        ++entry->connections;
+        key = entry->key;
+        return true;
+    }
+
+    void releaseConnection(Key key) {
+        if (key == 0) {
+            return;
+        }
+        size_t index = hash(key);
+        for (size_t probe = 0; probe < MAX_PROBES; ++probe, ++index) {
+            Entry &entry = entries_[index & mask_];
+            if (entry.key == key) {
+                if (entry.connections > 0) {
+                    --entry.connections;
+                }
+                return;
+            }
+        }
+    }
+
+    // Takes a token for one request.
+    bool allowRequest(const std::vector<ClientLimitRule> &rules,
+            const struct sockaddr_in &peer) {
+        if (peer.sin_family != AF_INET) {
+            return true;
+        }
+        uint32_t ip = ntohl(peer.sin_addr.s_addr);
+        const ClientLimitRule *rule = findRule(rules, ip);
+        if (!rule || rule->requests_per_second == 0) {
+            return true;
+        }
+        Entry *entry = find(makeKey(ip, *rule), *rule, nowMilliseconds());
+        if (!entry) {
+            return true;
+        }
+        if (entry->tokens < 1.0f) {
+            ++rejected_requests_;
+            return false;
+        }
+        entry->tokens -= 1.0f;
+        return true;
+    }
+
+    uint64_t rejectedConnections() const {
+        return rejected_connections_;
+    }
+
+    uint64_t rejectedRequests() const {
+        return rejected_requests_;
+    }
+};
+
+} // namespace mioproxy
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+namespace mioproxy {
+
+// Text lines for an operator (stderr), written by a helper thread so that a
+// slow terminal or log pipe never stalls a reactor. Lines are appended to
+// a batch under a short lock; once max_pending bytes are waiting, further
+// lines are counted as dropped.
+class DiagnosticLog {
+private:
+    int fd_;
+    size_t max_pending_;
+    std::atomic<uint64_t> dropped_;
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::string pending_;
+    bool stop_;
+    std::thread thread_;
+
+    void writeAll(const char *data, size_t size) {
+        while (size > 0) {
+            ssize_t result = ::write(fd_, data, size);
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            data += result;
+            size -= result;
+        }
+    }
+
+    void run() {
+        std::string batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this]() { return stop_ || !pending_.empty(); });
+                if (pending_.empty() && stop_) {
+                    return;
+                }
+                batch.swap(pending_);
+            }
+            writeAll(batch.data(), batch.size());
+            batch.clear();
+        }
+    }
+
+public:
+    explicit DiagnosticLog(int fd = STDERR_FILENO, size_t max_pending = 1 << 20) :
+        fd_(fd),
+        max_pending_(max_pending),
+        dropped_(0),
+        mutex_(),
+        ready_(),
+        pending_(),
+        stop_(false),
+        thread_(&DiagnosticLog::run, this)
+        {}
+
+    DiagnosticLog(const DiagnosticLog &) = delete;
+    DiagnosticLog &operator=(const DiagnosticLog &) = delete;
+
+    ~DiagnosticLog() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        ready_.notify_one();
+        thread_.join();
+    }
+
+    // One line, without the newline.
+    void write(const std::string &line) {
+        bool was_empty;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (pending_.size() + line.size() + 1 > max_pending_) {
+                ++dropped_;
+                return;
+            }
+            was_empty = pending_.empty();
+            pending_ += line;
+            pending_ += '\n';
+        }
+        if (was_empty) {
+            ready_.notify_one();
+        }
+    }
+
+    uint64_t dropped() const {
+        return dropped_;
+    }
+};
+
+} // namespace mioproxy
@@ -0,0 +1,620 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mio/mio.hpp"
+#include "mio/completion_queue.hpp"
+#include "mio/offload_pool.hpp"
+#include "mio/pipeline.hpp"
+
+namespace mioproxy {
+
+struct DiskCacheConfig {
+    std::string directory;
+    size_t index_entries;
+    size_t slab_bytes;
+    size_t max_slabs;
+    size_t max_object_bytes;
+
+    DiskCacheConfig() :
+        directory(),
+        index_entries(1 << 20),
+        slab_bytes(size_t(256) << 20),
+        max_slabs(16),
+        max_object_bytes(size_t(8) << 20)
+        {}
+};
+
+// An append-only data file. Shared so that a slab dropped by the writer
+// stays open until the last response being sent from it is done.
+class SlabFile {
+private:
+    int fd_;
+    uint32_t id_;
+    std::string path_;
+
+public:
+    SlabFile(const std::string &path, uint32_t id) :
+        fd_(::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)),
+        id_(id),
+        path_(path) {
+        if (fd_ == -1) {
+            throw std::runtime_error("Failed to open cache slab " + path);
+        }
+    }
+
+    SlabFile(const SlabFile &) = delete;
+    SlabFile &operator=(const SlabFile &) = delete;
+
+    ~SlabFile() {
+        ::close(fd_);
+    }
+
+    int getDescriptor() const {
+        return fd_;
+    }
+
+    uint32_t id() const {
+        return id_;
+    }
+
+    const std::string &path() const {
+        return path_;
+    }
+
+    off_t size() const {
+        struct stat status;
+        return ::fstat(fd_, &status) == 0 ? status.st_size : 0;
+    }
+};
+
+// A verified hit: where its bytes are in the slab.
+struct DiskCacheHit {
+    std::shared_ptr<SlabFile> slab;
+    off_t offset;
+    size_t length;
+};
+
+// Queued output that sends a hit a slice at a time. A slice already in the
+// page cache is read on the reactor with RWF_NOWAIT, which fails instead of
+// waiting for the disk; any other slice is read on the offload pool while
+// the writer moves on to other connections. The next slice is loaded while
+// one is being sent.
+class DiskCacheReader : public mio::pipeline::OutputSource,
+    public std::enable_shared_from_this<DiskCacheReader> {
+private:
+    static constexpr size_t SLICE_BYTES = 128 << 10;
+
+    std::shared_ptr<DiskCacheHit> hit_;
+    std::shared_ptr<mio::CompletionQueue> completions_;
+    std::shared_ptr<mio::OffloadPool> offload_;
+    size_t loaded_;
+    mio::Buffer ready_;
+    bool loading_;
+    bool failed_;
+
+    static bool readNow(int fd, const mio::Buffer &slice, off_t offset) {
+#ifdef RWF_NOWAIT
+        struct iovec iov = { slice->data(), slice->size() };
+        return ::preadv2(fd, &iov, 1, offset, RWF_NOWAIT) == ssize_t(slice->size());
+#else
+        return false;
+#endif
+    }
+
+    static bool readAll(int fd, const mio::Buffer &slice, off_t offset) {
+        size_t done = 0;
+        while (done < slice->size()) {
+            ssize_t result = ::pread(fd, slice->data() + done, slice->size() - done,
+                    offset + done);
+            if (result <= 0) {
+                if (result == -1 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            done += result;
+        }
+        return true;
+    }
+
+    void load() {
+        if (loading_ || failed_ || ready_ || loaded_ == hit_->length) {
+            return;
+        }
+        mio::Buffer slice = mio::createBuffer(std::min(SLICE_BYTES, hit_->length - loaded_));
+        off_t offset = hit_->offset + loaded_;
+        loaded_ += slice->size();
+        if (readNow(hit_->slab->getDescriptor(), slice, offset)) {
+            ready_ = slice;
+            return;
+        }
+
+        loading_ = true;
+        std::weak_ptr<DiskCacheReader> weak_reader = shared_from_this();
+        std::shared_ptr<SlabFile> slab = hit_->slab;
+        offload_->submit(completions_, [weak_reader, slab, slice, offset]() {
+            bool read = readAll(slab->getDescriptor(), slice, offset);
+            return std::function<void()>([weak_reader, slice, read]() {
+                auto reader = weak_reader.lock();
+                if (!reader) {
+                    return;
+                }
+                reader->loading_ = false;
+                if (read) {
+                    reader->ready_ = slice;
+                } else {
+                    reader->failed_ = true;
+                }
+            });
+        });
+    }
+
+public:
+    DiskCacheReader(std::shared_ptr<DiskCacheHit> hit,
+            std::shared_ptr<mio::CompletionQueue> completions,
+            std::shared_ptr<mio::OffloadPool> offload) :
+        hit_(hit),
+        completions_(completions),
+        offload_(offload),
+        loaded_(0),
+        ready_(),
+        loading_(false),
+        failed_(false)
+        {}
+
+    virtual size_t size() const {
+        return hit_->length;
+    }
+
+    virtual mio::Buffer next() {
+        load();
+        mio::Buffer slice = std::move(ready_);
+        ready_.reset();
+        if (slice) {
+            load();
+        }
+        return slice;
+    }
+
+    virtual bool failed() const {
+        return failed_;
+    }
+};
+
+// Second cache tier: complete upstream responses appended to slab files,
+// found through a compact index that is mmap'd (and prefaulted) so lookups
+// on the reactor touch memory only. Hits are verified and read ahead on the
+// offload pool, several at a time, and sent through a DiskCacheReader; appends and slab rolls stay in order on
+// the cache's own writer thread. Both report back through the reactor's
+// completion queue. The index and slab table are only ever modified on the
+// reactor.
+class DiskCache {
+public:
+    typedef std::function<void(std::shared_ptr<DiskCacheHit>)> LookupCallback;
+
+private:
+    static constexpr uint32_t RECORD_MAGIC = 0x6d696f63;   // "mioc"
+    static constexpr uint64_t INDEX_MAGIC = 0x31786469636f696dULL;  // "miocidx1"
+    static constexpr size_t MAX_PROBES = 8;
+
+    struct RecordHeader {
+        uint32_t magic;
+        uint32_t key_length;
+        uint64_t key_hash;
+        uint64_t body_length;
+        int64_t expires_at;
+    };
+
+    struct IndexHeader {
+        uint64_t magic;
+        uint64_t entries;
+    };
+
+    struct IndexEntry {
+        uint64_t key_hash;
+        uint64_t record_offset;
+        uint64_t body_length;
+        int64_t expires_at;
+        uint32_t slab_id;
+        uint32_t key_length;
+    };
+
+    DiskCacheConfig config_;
+    std::shared_ptr<mio::CompletionQueue> completions_;
+    std::shared_ptr<mio::OffloadPool> offload_;
+
+    void *index_map_;
+    size_t index_map_size_;
+    IndexEntry *index_;
+    size_t index_mask_;
+
+    // reactor side view of the slabs
+    std::map<uint32_t, std::shared_ptr<SlabFile>> slabs_;
+
+    // writer side state, touched by the helper thread only once it runs
+    std::shared_ptr<SlabFile> current_slab_;
+    off_t current_size_;
+    std::deque<std::shared_ptr<SlabFile>> writer_slabs_;
+
+    std::mutex jobs_mutex_;
+    std::condition_variable jobs_ready_;
+    std::deque<std::function<void()>> jobs_;
+    bool stop_;
+    std::thread thread_;
+
+    static uint64_t hash(const std::string &key) {
+        // FNV-1a, never 0 so that 0 can mark empty index slots
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (char c : key) {
+            hash = (hash ^ uint8_t(c)) * 0x100000001b3ULL;
+        }
+        return hash == 0 ? 1 : hash;
+    }
+
+    static int64_t now() {
+        return ::time(nullptr);
+    }
+
+    std::string slabPath(uint32_t id) const {
+        char name[32];
+        snprintf(name, sizeof(name), "/slab.%08u", id);
+        return config_.directory + name;
+    }
+
+    IndexEntry *findEntry(uint64_t key_hash) {
+        size_t index = key_hash;
+        for (size_t probe = 0; probe < MAX_PROBES; ++probe, ++index) {
+            IndexEntry &entry = index_[index & index_mask_];
+            if (entry.key_hash == key_hash) {
+                return &entry;
+            }
+            if (entry.key_hash == 0) {
+                return nullptr;
+            }
+        }
+        return nullptr;
+    }
+
+    // Slot for a new entry: the existing one for the key, an empty one, or
+    // else the one in the probe window that expires first.
+    IndexEntry &insertEntry(uint64_t key_hash) {
+        size_t index = key_hash;
+        IndexEntry *victim = nullptr;
+        for (size_t probe = 0; probe < MAX_PROBES; ++probe, ++index) {
+            IndexEntry &entry = index_[index & index_mask_];
+            if (entry.key_hash == key_hash || entry.key_hash == 0) {
+                return entry;
+            }
+            if (!victim || entry.expires_at < victim->expires_at) {
+                victim = &entry;
+            }
+        }
+        return *victim;
+    }
+
+    void addEntry(const RecordHeader &header, uint32_t slab_id, uint64_t record_offset) {
+        IndexEntry &entry = insertEntry(header.key_hash);
+        entry.key_hash = header.key_hash;
+        entry.record_offset = record_offset;
+        entry.body_length = header.body_length;
+        entry.expires_at = header.expires_at;
+        entry.slab_id = slab_id;
+        entry.key_length = header.key_length;
+    }
+
+    bool mapIndex() {
+        std::string path = config_.directory + "/index";
+        size_t entries = 1;
+        while (entries < config_.index_entries) {
+            entries <<= 1;
+        }
+        index_map_size_ = sizeof(IndexHeader) + entries * sizeof(IndexEntry);
+
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            throw std::runtime_error("Failed to open cache index " + path);
+        }
+        struct stat status;
+        bool valid = ::fstat(fd, &status) == 0 && size_t(status.st_size) == index_map_size_;
+        if (!valid && ::ftruncate(fd, 0) == 0 && ::ftruncate(fd, index_map_size_) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Failed to size cache index");
+        }
+        // prefaulted so that lookups on the reactor never wait for the disk
+        index_map_ = ::mmap(nullptr, index_map_size_, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, 0);
+        ::close(fd);
+        if (index_map_ == MAP_FAILED) {
+            throw std::runtime_error("Failed to map cache index");
+        }
+
+        IndexHeader *header = (IndexHeader *) index_map_;
+        index_ = (IndexEntry *) (header + 1);
+        index_mask_ = entries - 1;
+        valid = valid && header->magic == INDEX_MAGIC && header->entries == entries;
+        if (!valid) {
+            memset(index_map_, 0, index_map_size_);
+            header->magic = INDEX_MAGIC;
+            header->entries = entries;
+        }
+        return valid;
+    }
+
+    void openSlabs() {
+        DIR *directory = ::opendir(config_.directory.c_str());
+        if (!directory) {
+            throw std::runtime_error("Failed to open cache directory " + config_.directory);
+        }
+        while (struct dirent *file = ::readdir(directory)) {
+            unsigned id;
+            if (sscanf(file->d_name, "slab.%08u", &id) == 1) {
+                slabs_[id] = std::make_shared<SlabFile>(slabPath(id), id);
+            }
+        }
+        ::closedir(directory);
+
+        for (auto &slab : slabs_) {
+            writer_slabs_.push_back(slab.second);
+        }
+        if (slabs_.empty()) {
+            auto slab = std::make_shared<SlabFile>(slabPath(0), 0);
+            slabs_[0] = slab;
+            writer_slabs_.push_back(slab);
+        }
+        current_slab_ = writer_slabs_.back();
+        current_size_ = current_slab_->size();
+    }
+
+    // Rebuilds the index from the record headers in the slabs, oldest slab
+    // first so that newer copies of a key win. Only headers are read, bodies
+    // are skipped over. Stops at the first torn record of a slab.
+    void rebuildIndex() {
+        for (auto &slab : slabs_) {
+            off_t offset = 0;
+            off_t size = slab.second->size();
+            RecordHeader header;
+            while (offset + off_t(sizeof(header)) <= size &&
+                    ::pread(slab.second->getDescriptor(), &header, sizeof(header), offset) ==
+                        sizeof(header) &&
+                    header.magic == RECORD_MAGIC) {
+                off_t next = offset + sizeof(header) + header.key_length + header.body_length;
+                if (next > size) {
+                    break;
+                }
+                addEntry(header, slab.first, offset);
+                offset = next;
+            }
+        }
+    }
+
+    void run() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(jobs_mutex_);
+                while (jobs_.empty() && !stop_) {
+                    jobs_ready_.wait(lock);
+                }
+                if (jobs_.empty()) {
+                    return;
+                }
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+            }
+            job();
+        }
+    }
+
+    void submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex_);
+            jobs_.push_back(std::move(job));
+        }
+        jobs_ready_.notify_one();
+    }
+
+    // offload pool: checks that the record really holds key, then starts
+    // pulling the body into the page cache, so that the reader's slices are
+    // mostly found there
+    static std::shared_ptr<DiskCacheHit> readHit(std::shared_ptr<SlabFile> slab,
+            const IndexEntry &entry, const std::string &key) {
+        std::vector<char> head(sizeof(RecordHeader) + key.size());
+        if (::pread(slab->getDescriptor(), head.data(), head.size(), entry.record_offset) !=
+                ssize_t(head.size())) {
+            return nullptr;
+        }
+        RecordHeader header;
+        memcpy(&header, head.data(), sizeof(header));
+        if (header.magic != RECORD_MAGIC || header.key_length != key.size() ||
+                memcmp(head.data() + sizeof(header), key.data(), key.size()) != 0) {
+            return nullptr;
+        }
+
+        auto hit = std::make_shared<DiskCacheHit>();
+        hit->slab = slab;
+        hit->offset = entry.record_offset + head.size();
+        hit->length = header.body_length;
+        ::readahead(slab->getDescriptor(), hit->offset, hit->length);
+        return hit;
+    }
+
+    // pwritev takes at most IOV_MAX buffers, and a large body is made of
+    // thousands of received chunks
+    static bool writeAll(int fd, const std::vector<struct iovec> &iov, uint64_t offset) {
+        for (size_t first = 0; first < iov.size(); ) {
+            size_t count = std::min(iov.size() - first, size_t(IOV_MAX));
+            size_t length = 0;
+            for (size_t i = first; i < first + count; ++i) {
+                length += iov[i].iov_len;
+            }
+            if (::pwritev(fd, &iov[first], count, offset) != ssize_t(length)) {
+                return false;
+            }
+            offset += length;
+            first += count;
+        }
+        return true;
+    }
+
+    // helper thread: appends one record, rolling over to a new slab and
+    // dropping the oldest one as needed
+    void append(const std::string &key, const std::vector<mio::Buffer> &body,
+            size_t body_length, int64_t expires_at) {
+        size_t record_length = sizeof(RecordHeader) + key.size() + body_length;
+        std::shared_ptr<SlabFile> new_slab;
+        std::shared_ptr<SlabFile> dropped_slab;
+
+        if (current_size_ > 0 && current_size_ + record_length > config_.slab_bytes) {
+            new_slab = std::make_shared<SlabFile>(slabPath(current_slab_->id() + 1),
+                    current_slab_->id() + 1);
+            writer_slabs_.push_back(new_slab);
+            current_slab_ = new_slab;
+            current_size_ = 0;
+            if (writer_slabs_.size() > config_.max_slabs) {
+                dropped_slab = writer_slabs_.front();
+                writer_slabs_.pop_front();
+                ::unlink(dropped_slab->path().c_str());
+            }
+        }
+
+        RecordHeader header = { RECORD_MAGIC, uint32_t(key.size()), hash(key),
+            body_length, expires_at };
+        std::vector<struct iovec> iov;
+        iov.push_back({ &header, sizeof(header) });
+        iov.push_back({ const_cast<char *>(key.data()), key.size() });
+        for (auto &chunk : body) {
+            iov.push_back({ chunk->data(), chunk->size() });
+        }
+
+        uint64_t offset = current_size_;
+        if (!writeAll(current_slab_->getDescriptor(), iov, offset)) {
+            // leave a torn tail behind, it is never indexed
+            current_size_ = current_slab_->size();
+            return;
+        }
+        current_size_ += record_length;
+
+        uint32_t slab_id = current_slab_->id();
+        completions_->post([this, header, slab_id, offset, new_slab, dropped_slab]() {
+            if (new_slab) {
+                slabs_[new_slab->id()] = new_slab;
+            }
+            if (dropped_slab) {
+                slabs_.erase(dropped_slab->id());
+            }
+            addEntry(header, slab_id, offset);
+        });
+    }
+
+public:
+    DiskCache(const DiskCacheConfig &config,
+            std::shared_ptr<mio::CompletionQueue> completions,
+            std::shared_ptr<mio::OffloadPool> offload) :
+        config_(config),
+        completions_(completions),
+        offload_(offload),
+        index_map_(nullptr),
+        index_map_size_(0),
+        index_(nullptr),
+        index_mask_(0),
+        slabs_(),
+        current_slab_(),
+        current_size_(0),
+        writer_slabs_(),
+        jobs_mutex_(),
+        jobs_ready_(),
+        jobs_(),
+        stop_(false),
+        thread_() {
+        ::mkdir(config_.directory.c_str(), 0755);
+        bool index_valid = mapIndex();
+        openSlabs();
+        if (!index_valid) {
+            rebuildIndex();
+        }
+        thread_ = std::thread(&DiskCache::run, this);
+    }
+
+    DiskCache(const DiskCache &) = delete;
+    DiskCache &operator=(const DiskCache &) = delete;
+
+    ~DiskCache() {
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex_);
+            stop_ = true;
+        }
+        jobs_ready_.notify_one();
+        thread_.join();
+        ::msync(index_map_, index_map_size_, MS_ASYNC);
+        ::munmap(index_map_, index_map_size_);
+    }
+
+    size_t maxObjectBytes() const {
+        return config_.max_object_bytes;
+    }
+
+    // Calls done on the reactor with a hit, or with null on a miss. Misses
+    // that the index alone can tell are answered right away.
+    void lookup(const std::string &key, LookupCallback done) {
+        IndexEntry *found = findEntry(hash(key));
+        if (!found || found->expires_at <= now() || found->key_length != key.size()) {
+            done(nullptr);
+            return;
+        }
+        auto slab = slabs_.find(found->slab_id);
+        if (slab == slabs_.end()) {
+            done(nullptr);
+            return;
+        }
+
+        IndexEntry entry = *found;
+        std::shared_ptr<SlabFile> slab_file = slab->second;
+        offload_->submit(completions_, [slab_file, entry, key, done]() {
+            auto hit = readHit(slab_file, entry, key);
+            return std::function<void()>([done, hit]() { done(hit); });
+        });
+    }
+
+    // output that sends the body of a hit
+    std::shared_ptr<mio::pipeline::OutputSource> reader(std::shared_ptr<DiskCacheHit> hit) {
+        return std::make_shared<DiskCacheReader>(hit, completions_, offload_);
+    }
+
+    void store(const std::string &key, std::vector<mio::Buffer> body, int64_t ttl_seconds) {
+        size_t body_length = 0;
+        for (auto &chunk : body) {
+            body_length += chunk->size();
+        }
+        if (body_length == 0 || body_length > config_.max_object_bytes) {
+            return;
+        }
+        int64_t expires_at = now() + ttl_seconds;
+        submit([this, key, body, body_length, expires_at]() {
+            append(key, body, body_length, expires_at);
+        });
+    }
+};
+
+} // namespace mioproxy
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <strings.h>
+
+#include "mio/mio.hpp"
+#include "mio/io_buf.hpp"
+
+namespace mioproxy {
+
+// Request header edits for one route.
+struct HeaderRules {
+    bool forwarded_for;         // append the client address to X-Forwarded-For
+    std::string via;            // add "Via: 1.1 <via>" unless empty
+    bool strip_hop_by_hop;      // drop Connection, Keep-Alive, Upgrade etc.
+    std::string host;           // replaces the Host header unless empty
+    std::string connection;     // replaces the Connection header unless empty
+
+    HeaderRules() :
+        forwarded_for(false),
+        via(),
+        strip_hop_by_hop(false),
+        host(),
+        connection()
+        {}
+
+    // "rewrite <host> forwarded_for | via <name> | strip_hop_by_hop |
+    //  host <name> | connection <value>"
+    void set(const std::string &rule, const std::string &value) {
+        if (rule == "forwarded_for") {
+            forwarded_for = true;
+        } else if (rule == "via") {
+            via = value;
+        } else if (rule == "strip_hop_by_hop") {
+            strip_hop_by_hop = true;
+        } else if (rule == "host") {
+            host = value;
+        } else if (rule == "connection") {
+            connection = value;
+        } else {
+            throw std::runtime_error("Unknown rewrite rule " + rule);
+        }
+        if ((rule == "via" || rule == "host" || rule == "connection") && value.empty()) {
+            throw std::runtime_error("rewrite " + rule + " needs a value");
+        }
+    }
+};
+
+// Applies HeaderRules to a complete request header block. The result is a
+// chain over the received buffer with the new header lines in between, so
+// kept headers are never copied.
+class HeaderRewriter {
+private:
+    static bool nameIs(const char *line, size_t name_length, const char *name) {
+        return name_length == strlen(name) && strncasecmp(line, name, name_length) == 0;
+    }
+
+    static bool hopByHop(const char *line, size_t name_length,
+            const std::vector<std::string> &connection_tokens) {
+        // Transfer-Encoding is left alone: the request is passed on with
+        // its framing unchanged
+        static const char *HEADERS[] = { "Connection", "Keep-Alive", "Proxy-Connection",
+            "TE", "Trailer", "Upgrade", "Proxy-Authorization" };
+        for (const char *header : HEADERS) {
+            if (nameIs(line, name_length, header)) {
+                return true;
+            }
+        }
+        for (auto &token : connection_tokens) {
+            if (nameIs(line, name_length, token.c_str())) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Header names listed in "Connection: a, b" are hop-by-hop as well.
+    static void parseConnectionTokens(const char *value, const char *end,
+            std::vector<std::string> &tokens) {
+        const char *token = value;
+        for (const char *seek = value; seek <= end; ++seek) {
+            if (seek == end || *seek == ',') {
+                const char *begin = token;
+                const char *finish = seek;
+                while (begin < finish && (*begin == ' ' || *begin == '\t')) {
+                    ++begin;
+                }
+                while (finish > begin && (finish[-1] == ' ' || finish[-1] == '\t' ||
+                            finish[-1] == '\r')) {
+                    --finish;
+                }
+                if (finish > begin) {
+                    tokens.push_back(std::string(begin, finish));
+                }
+                token = seek + 1;
+            }
+        }
+    }
+
+public:
+    static mio::IoBuf rewrite(const HeaderRules &rules,
+            const mio::Buffer &request,
+            const struct sockaddr_in &peer_address) {
+        mio::IoBuf message;
+        const char *data = request->data();
+        size_t size = request->size();
+
+        // a UNIX socket peer has no address, whatever it forwarded stays
+        bool forwarded_for = rules.forwarded_for && peer_address.sin_family == AF_INET;
+        char client_ip[INET_ADDRSTRLEN] = "";
+        if (forwarded_for) {
+            inet_ntop(AF_INET, &peer_address.sin_addr, client_ip, sizeof(client_ip));
+        }
+
+        std::vector<std::string> connection_tokens;
+        if (rules.strip_hop_by_hop) {
+            for (size_t line = 0; line < size; ) {
+                const char *end = static_cast<const char *>(memchr(data + line, '\n', size - line));
+                size_t next = end ? end - data + 1 : size;
+                const char *colon = static_cast<const char *>(memchr(data + line, ':', next - line));
+                if (colon && nameIs(data + line, colon - data - line, "Connection")) {
+                    parseConnectionTokens(colon + 1, data + next - 1, connection_tokens);
+                }
+                line = next;
+            }
+        }
+
+        bool forwarded_for_done = false;
+        size_t kept = 0;            // start of the bytes not yet appended
+        size_t line = 0;
+        while (line < size) {
+            const char *end = static_cast<const char *>(memchr(data + line, '\n', size - line));
+            size_t next = end ? end - data + 1 : size;
+            size_t length = next - line;
+            if (line == 0 || length <= 2) {
+                // request line, or the empty line ending the headers
+                if (length <= 2 && line != 0) {
+                    break;
+                }
+                line = next;
+                continue;
+            }
+
+            const char *colon = static_cast<const char *>(memchr(data + line, ':', length));
+            size_t name_length = colon ? colon - data - line : 0;
+            const char *name = data + line;
+
+            bool drop = false;
+            std::string replacement;
+            if (rules.strip_hop_by_hop && hopByHop(name, name_length, connection_tokens)) {
+                drop = true;
+            } else if (!rules.host.empty() && nameIs(name, name_length, "Host")) {
+                drop = true;
+                replacement = "Host: " + rules.host + "\r\n";
+            } else if (!rules.connection.empty() && nameIs(name, name_length, "Connection")) {
+                drop = true;
+            } else if (forwarded_for && !forwarded_for_done &&
+                    nameIs(name, name_length, "X-Forwarded-For")) {
+                // keep the line up to its line break and extend the list
+                size_t value_end = next - (length >= 2 && data[next - 2] == '\r' ? 2 : 1);
+                message.append(request, kept, value_end - kept);
+                message.appendCopy(", ");
+                message.appendCopy(client_ip, strlen(client_ip));
+                message.appendCopy("\r\n", 2);
+                kept = next;
+                forwarded_for_done = true;
+            }
+
+            if (drop) {
+                message.append(request, kept, line - kept);
+                message.appendCopy(replacement);
+                kept = next;
+            }
+            line = next;
+        }
+
+        // everything up to the empty line, then the added headers
+        message.append(request, kept, line - kept);
+        if (forwarded_for && !forwarded_for_done) {
+            message.appendCopy("X-Forwarded-For: ", 17);
+            message.appendCopy(client_ip, strlen(client_ip));
+            message.appendCopy("\r\n", 2);
+        }
+        if (!rules.via.empty()) {
+            message.appendCopy("Via: 1.1 " + rules.via + "\r\n");
+        }
+        if (!rules.connection.empty()) {
+            message.appendCopy("Connection: " + rules.connection + "\r\n");
+        }
+        message.append(request, line, size - line);
+        return message;
+    }
+};
+
+} // namespace mioproxy
@@ -6,49 +6,197 @@
 #include <functional>
 
 #include "mio/mio.hpp"
+#include "mio/io_buf.hpp"
+#include "mio/string_ref.hpp"
 
 namespace mioproxy {
 
-class InputHttpProtocol : public mio::InputProtocol {
+// Value of the first header called name in block (without the colon, any
+// case), with surrounding blanks trimmed; false if there is none.
+inline bool findHeader(mio::StringRef block, mio::StringRef name, mio::StringRef &value) {
+    size_t line_end = block.find('\n');
+    while (line_end != mio::StringRef::npos) {
+        size_t line = line_end + 1;
+        line_end = block.find('\n', line);
+        if (block.size() - line <= name.size() || block[line + name.size()] != ':' ||
+                !block.substr(line, name.size()).equalsIgnoreCase(name)) {
+            continue;
+        }
+        size_t begin = line + name.size() + 1;
+        size_t end = line_end == mio::StringRef::npos ? block.size() : line_end;
+        while (begin < end && (block[begin] == ' ' || block[begin] == '\t')) {
+            ++begin;
+        }
+        while (end > begin && (block[end - 1] == '\r' || block[end - 1] == ' ' ||
+                    block[end - 1] == '\t')) {
+            --end;
+        }
+        value = block.substr(begin, end - begin);
+        return true;
+    }
+    return false;
+}
+
+inline bool hasHeader(mio::StringRef block, mio::StringRef name) {
+    mio::StringRef value;
+    return findHeader(block, name, value);
+}
+
+// What routing needs from a header block, as views into it: the request
+// target's path and the Host header's name without the port.
+struct RequestHead {
+    mio::StringRef path;
+    mio::StringRef host;
+
+    // False if there is no Host header.
+    static bool parse(mio::StringRef block, RequestHead &head) {
+        size_t line_end = block.find('\n');
+        mio::StringRef request_line = block.substr(0, line_end);
+        size_t target = request_line.find(' ');
+        if (target != mio::StringRef::npos) {
+            ++target;
+            size_t target_end = request_line.find(' ', target);
+            mio::StringRef path = request_line.substr(target,
+                    target_end == mio::StringRef::npos ? mio::StringRef::npos : target_end - target);
+            // absolute form, "http://host/path"
+            if (!path.empty() && path[0] != '/') {
+                size_t scheme = path.find(':');
+                size_t slash = scheme == mio::StringRef::npos ?
+                    mio::StringRef::npos : path.find('/', scheme + 3);
+                path = slash == mio::StringRef::npos ? mio::StringRef() : path.substr(slash);
+            }
+            head.path = path;
+        }
+
+        mio::StringRef value;
+        if (!findHeader(block, mio::StringRef("host", 4), value)) {
+            return false;
+        }
+        size_t end = 0;
+        while (end < value.size() && isHostChar(value[end])) {
+            ++end;
+        }
+        head.host = value.substr(0, end);
+        return true;
+    }
+
 private:
-    std::shared_ptr<mio::RequestHandler> request_handler_;
-    mio::Buffer buffer_;
+    static bool isHostChar(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            (c >= '0' && c <= '9') || c == '.' || c == '-';
+    }
+};
+
+namespace pipeline {
+
+// Splits the input into header blocks ending with an empty line. Partial
+// requests are held as references to the received chunks; a request that
+// arrived in one chunk of its own is handed on as that very buffer, and
+// only one spanning several chunks or sharing one is copied, once.
+template<typename Handler>
+class InputHttpProtocol {
+private:
+    Handler request_handler_;
+    mio::LocalIoBuf pending_;
+    // how much of "\r\n\r\n" the bytes seen so far end with
+    size_t matched_;
 
 public:
-    InputHttpProtocol(std::shared_ptr<mio::RequestHandler> request_handler) :
-        request_handler_(request_handler),
-        buffer_(std::make_shared<mio::BufferVector>())
+    template<typename... Args>
+    explicit InputHttpProtocol(Args &&... args) :
+        request_handler_(std::forward<Args>(args)...),
+        pending_(),
+        matched_(0)
         {}
 
-    virtual void processDataChunk(mio::Buffer buffer) {
-        auto buffer_begin = buffer->begin();
-        auto buffer_seek = buffer->begin();
-
-        while (buffer_seek != buffer->end()) {  
-            if (std::distance(buffer_begin, buffer_seek) >= 4 &&
-                    *buffer_seek == '\n' && 
-                    *(buffer_seek - 1) == '\r' &&
-                    *(buffer_seek - 2) == '\n' &&
-                    *(buffer_seek - 3) == '\r') {
-                buffer_->insert(buffer_->end(), buffer_begin, buffer_seek);
-                buffer_->push_back('\n');
-
-                request_handler_->handleRequest(buffer_);
-
-                buffer_ = std::make_shared<mio::BufferVector>();
-
-                buffer_begin = buffer_seek + 1;
-                if (buffer_begin != buffer->end() && *buffer_begin == '\0') {
-                    ++buffer_begin;
-                }
+    void processDataChunk(mio::Buffer buffer) {
+        static const char TERMINATOR[] = "\r\n\r\n";
+        const char *data = buffer->data();
+        size_t size = buffer->size();
+        size_t begin = 0;
+
+        for (size_t seek = 0; seek < size; ++seek) {
+            if (data[seek] == TERMINATOR[matched_]) {
+                ++matched_;
+            } else {
+                matched_ = data[seek] == '\r' ? 1 : 0;
+            }
+            if (matched_ < 4) {
+                continue;
+            }
+            matched_ = 0;
+            pending_.append(buffer, begin, seek + 1 - begin);
+            mio::Buffer request = pending_.toBuffer();
+            pending_.clear();
+
+            request_handler_.handleRequest(request);
+
+            begin = seek + 1;
+            if (begin != size && data[begin] == '\0') {
+                ++begin;
+                ++seek;
             }
-            ++buffer_seek;
         }
 
-        if (buffer_begin != buffer->end()) {
-            buffer_->insert(buffer_->end(), buffer_begin, buffer->end());
+        if (begin != size) {
+            pending_.append(buffer, begin, size - begin);
         }
     }
+
+    Handler &handler() {
+        return request_handler_;
+    }
+};
+
+template<typename Handler>
+class InputBinaryProtocol {
+private:
+    Handler request_handler_;
+
+public:
+    template<typename... Args>
+    explicit InputBinaryProtocol(Args &&... args) :
+        request_handler_(std::forward<Args>(args)...)
+        {}
+
+    void processDataChunk(mio::Buffer buffer) {
+        request_handler_.handleRequest(buffer);
+    }
+
+    Handler &handler() {
+        return request_handler_;
+    }
+};
+
+// Adapts a refcounted virtual handler to the static protocols above.
+class SharedRequestHandler {
+private:
+    std::shared_ptr<mio::RequestHandler> request_handler_;
+
+public:
+    explicit SharedRequestHandler(std::shared_ptr<mio::RequestHandler> request_handler) :
+        request_handler_(request_handler)
+        {}
+
+    void handleRequest(mio::Buffer request) {
+        request_handler_->handleRequest(request);
+    }
+};
+
+} // namespace pipeline
+
+class InputHttpProtocol : public mio::InputProtocol {
+private:
+    pipeline::InputHttpProtocol<pipeline::SharedRequestHandler> protocol_;
+
+public:
+    InputHttpProtocol(std::shared_ptr<mio::RequestHandler> request_handler) :
+        protocol_(request_handler)
+        {}
+
+    virtual void processDataChunk(mio::Buffer buffer) {
+        protocol_.processDataChunk(buffer);
+    }
 };
 
 class InputBinaryProtocol : public mio::InputProtocol {
@@ -73,7 +221,7 @@ public:
 
     virtual mio::Buffer getResponse(mio::Buffer buffer) {
         return buffer;
-    } 
+    }
 };
 
 } // namespace mio
@@ -2,88 +2,251 @@
 
 namespace mioproxy {
 
-class ProxyBackendRequestHandler;
+// Where a server connection goes: a resolved TCP address, or a UNIX
+// socket for servers routed as "unix:...".
+struct UpstreamAddress {
+    std::shared_ptr<mio::InternetAddress> internet;
+    std::shared_ptr<mio::UnixAddress> local;
+
+    // options only apply to TCP
+    std::shared_ptr<mio::ClientSocket> connect
+        (const mio::SocketOptions &options = mio::SocketOptions(),
+         const std::shared_ptr<mio::ArenaPool> &arena = nullptr) const {
+        if (local) {
+            return mio::allocateShared<mio::ClientSocket>(arena, *local);
+        }
+        return mio::allocateShared<mio::ClientSocket>(arena, *internet, options);
+    }
+};
+
+// Calls done on the reactor with the address of the server, or with null
+// if it does not resolve. IP addresses and UNIX sockets are answered right
+// away; names are looked up on the offload pool so that the reactor never
+// waits for DNS.
+inline void resolveUpstream(ProxyContext &context,
+        const Upstream &upstream,
+        std::function<void(std::shared_ptr<const UpstreamAddress>)> done) {
+    auto address = std::make_shared<UpstreamAddress>();
+    if (upstream.isUnix()) {
+        address->local = std::make_shared<mio::UnixAddress>
+            (mio::UnixAddress::parse(upstream.host));
+        done(address);
+        return;
+    }
+    if (mio::InternetAddress::isIP(upstream.host)) {
+        address->internet = std::make_shared<mio::InternetAddress>
+            (mio::InternetAddress::getAddressByIP(upstream.host, upstream.port));
+        done(address);
+        return;
+    }
+    std::string host = upstream.host;
+    int port = upstream.port;
+    context.offload->submit(context.completions, [host, port, address, done]() {
+        try {
+            address->internet = std::make_shared<mio::InternetAddress>
+                (mio::InternetAddress::getAddressByHostname(host, port));
+        } catch (const std::runtime_error &) {
+        }
+        std::shared_ptr<const UpstreamAddress> result;
+        if (address->internet) {
+            result = address;
+        }
+        return std::function<void()>([done, result]() { done(result); });
+    });
+}
 
-class ProxyBackendRequestHandler : public mio::RequestHandler {
+class ProxyBackendRequestHandler {
 private:
-    std::weak_ptr<mio::Connection> client_connection_;
+    std::shared_ptr<UpstreamFetch> fetch_;
+    size_t attempt_;
 
 public:
-    ProxyBackendRequestHandler(std::weak_ptr<mio::Connection> connection) :
-        client_connection_(connection)
+    ProxyBackendRequestHandler(mio::pipeline::ConnectionBase &,
+            std::shared_ptr<UpstreamFetch> fetch,
+            size_t attempt) :
+        fetch_(fetch),
+        attempt_(attempt)
         {}
 
-    virtual void handleRequest(mio::Buffer request) {
-        std::shared_ptr<mio::Connection> conn = client_connection_.lock();
-        if (conn) {
-            conn->addOutput(request);
+    void handleRequest(mio::Buffer response) {
+        if (!fetch_->connected(attempt_)) {
+            fetch_->onConnected(attempt_);
         }
+        fetch_->onResponseData(attempt_, response);
+    }
+
+    UpstreamFetch &fetch() {
+        return *fetch_;
+    }
+
+    size_t attempt() const {
+        return attempt_;
     }
 };
 
-class ProxyBackendCloser : public mio::Closer {
+typedef mio::pipeline::Connection<
+        mio::pipeline::AsyncReader<pipeline::InputBinaryProtocol<ProxyBackendRequestHandler>>,
+        mio::pipeline::AsyncWriter<OutputBinaryProtocol>>
+    ProxyBackendPipeline;
+
+class ProxyBackendConnection : public ProxyBackendPipeline {
 private:
-    std::weak_ptr<mio::Connection> client_connection_;
+    ProxyContext &context_;
+
+    // With fast open the socket is writable before the handshake, so being
+    // writable does not prove the connect succeeded; the TCP state does.
+    // Other sockets (UNIX) are connected once writable.
+    bool handshakeDone() {
+        struct tcp_info info;
+        socklen_t length = sizeof(info);
+        if (::getsockopt(getDescriptor(), IPPROTO_TCP, TCP_INFO, &info, &length) != 0) {
+            return true;
+        }
+        return info.tcpi_state != TCP_SYN_SENT && info.tcpi_state != TCP_CLOSE;
+    }
 
 public:
-    explicit ProxyBackendCloser(std::weak_ptr<mio::Connection> client_connection) :
-        client_connection_(client_connection)
-        {}
+    ProxyBackendConnection(ProxyContext &context,
+            std::shared_ptr<mio::Socket> socket,
+            std::shared_ptr<UpstreamFetch> fetch,
+            size_t attempt) :
+        ProxyBackendPipeline(context.arena, socket, fetch, attempt),
+        context_(context) {
+        ++context_.backend_connections;
+    }
+
+    virtual void onOutput() {
+        auto &handler = input_.protocol().handler();
+        if (!handler.fetch().connected(handler.attempt()) && handshakeDone()) {
+            handler.fetch().onConnected(handler.attempt());
+        }
+        ProxyBackendPipeline::onOutput();
+    }
+
+    bool connected() {
+        auto &handler = input_.protocol().handler();
+        return handler.fetch().connected(handler.attempt());
+    }
 
     virtual void onClose() {
-        std::shared_ptr<mio::Connection> conn = client_connection_.lock();
+        --context_.backend_connections;
+        auto &handler = input_.protocol().handler();
+        handler.fetch().onAttemptClosed(handler.attempt());
+    }
 
-        if (conn) {
-            conn->setCloseAfterOutput();
+    static std::shared_ptr<ProxyBackendConnection> create
+        (ProxyContext &context,
+         const UpstreamAddress &address,
+         const mio::SocketOptions &options,
+         std::shared_ptr<UpstreamFetch> fetch,
+         size_t attempt) {
+        mio::AllocationScope heap_allocations;
+        uint64_t arena_allocations = context.arenaAllocations();
+        auto connection = mio::allocateShared<ProxyBackendConnection>(context.arena, context,
+                address.connect(options, context.arena), fetch, attempt);
+        if (context.capture) {
+            connection->startCapture(context.capture, mio::CaptureRecordHeader::UPSTREAM);
+        }
+        context.connection_manager->addConnection(connection);
+        fetch->setAttemptConnection(attempt, connection);
+        context.backend_allocations.record(heap_allocations,
+                context.arenaAllocations() - arena_allocations);
+
+        // a connect that neither completes nor fails is given up on, which
+        // counts against the server like a refused one
+        auto timeout = context.config->connect_timeout;
+        if (timeout.count() != 0) {
+            std::weak_ptr<ProxyBackendConnection> weak_connection = connection;
+            context.connection_manager->addTimer(timeout, [&context, weak_connection]() {
+                auto connection = weak_connection.lock();
+                if (connection && !connection->connected()) {
+                    context.connection_manager->removeConnection(connection);
+                }
+            });
         }
+        return connection;
     }
 };
 
-class ProxyBackendConnection : public mio::ConnectionWithOutput,
-    public std::enable_shared_from_this<ProxyBackendConnection> {
+// Opens a TCP connection to a routed server and closes it as soon as the
+// connect completes; the result goes to the server's health entry.
+class HealthProbeConnection : public mio::Connection {
 private:
-    std::queue<mio::Buffer> output_queue_;
+    ProxyContext &context_;
+    UpstreamHealth &health_;
+    bool connected_;
 
-    ProxyBackendConnection(std::shared_ptr<mio::ConnectionManager> connection_manager,
+public:
+    HealthProbeConnection(ProxyContext &context,
             std::shared_ptr<mio::Socket> socket,
-            std::shared_ptr<mio::Connection> client_connection) :
+            UpstreamHealth &health) :
+        mio::Connection(socket, nullptr, nullptr, nullptr),
+        context_(context),
+        health_(health),
+        connected_(false) {
+        health_.setProbing(true);
+    }
 
-        ConnectionWithOutput(socket, 
-            nullptr, 
-            std::make_shared<mio::AsyncWriter>(socket,
-                std::make_shared<OutputBinaryProtocol>()), 
-            std::make_shared<ProxyBackendCloser>(client_connection)) {
+    virtual bool onInput() {
+        onOutput();
+        return false;
+    }
 
-        reader_ = initReader(socket, client_connection);
-        
-        std::shared_ptr<ProxyBackendConnection> this_ptr(this);
-        connection_manager->addConnection(this_ptr);    
+    virtual void onOutput() {
+        connected_ = true;
+        need_close_ = true;
     }
 
-    std::shared_ptr<mio::AsyncReader> initReader(std::shared_ptr<mio::Socket> socket, 
-            std::shared_ptr<mio::Connection> client_connection) {
-        auto request_handler = std::make_shared<ProxyBackendRequestHandler>
-                (client_connection);
+    virtual void onClose() {
+        health_.setProbing(false);
+        context_.upstream_health.reportProbe(health_, connected_);
+    }
 
-        return std::make_shared<mio::AsyncReader>(socket, 
-                std::make_shared<InputBinaryProtocol>(request_handler)); 
+    virtual void addOutput(mio::Buffer) {}
+
+    bool connected() const {
+        return connected_;
     }
 
-public:
-    static std::shared_ptr<ProxyBackendConnection> create
-        (std::weak_ptr<mio::ConnectionManager> connection_manager,
-         std::string host,
-         std::weak_ptr<mio::Connection> client_connection) {
-
-        std::shared_ptr<mio::ConnectionManager> conn_m = connection_manager.lock();
-        std::shared_ptr<mio::Connection> conn = client_connection.lock();
-
-        if (conn_m && conn) {
-            auto socket = std::make_shared<mio::ClientSocket>(host);
-            return (new ProxyBackendConnection(conn_m, socket, conn))->shared_from_this();
-        } else {
-            return nullptr;
+    static void create(ProxyContext &context, UpstreamHealth &health) {
+        if (health.probing()) {
+            return;
+        }
+        health.setProbing(true);
+        UpstreamHealth *health_ptr = &health;
+        resolveUpstream(context, health.server(),
+                [&context, health_ptr](std::shared_ptr<const UpstreamAddress> address) {
+            health_ptr->setProbing(false);
+            connect(context, *health_ptr, address);
+        });
+    }
+
+    static void connect(ProxyContext &context,
+            UpstreamHealth &health,
+            std::shared_ptr<const UpstreamAddress> address) {
+        std::shared_ptr<HealthProbeConnection> connection;
+        try {
+            if (!address) {
+                throw std::runtime_error("Failed to resolve");
+            }
+            connection = std::make_shared<HealthProbeConnection>(context,
+                    address->connect(), health);
+        } catch (const std::runtime_error &) {
+            context.upstream_health.reportProbe(health, false);
+            return;
         }
+        context.connection_manager->addConnection(connection);
+
+        std::weak_ptr<HealthProbeConnection> weak_connection = connection;
+        const ProxyConfig &config = *context.config;
+        context.connection_manager->addTimer(config.connect_timeout.count() != 0 ?
+                config.connect_timeout : config.health_check_interval,
+                [&context, weak_connection]() {
+            auto connection = weak_connection.lock();
+            if (connection && !connection->connected()) {
+                context.connection_manager->removeConnection(connection);
+            }
+        });
     }
 };
 
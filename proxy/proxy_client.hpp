@@ -2,81 +2,416 @@
 
 namespace mioproxy {
 
-class ProxyBackendConnection;
-class ProxyClientRequestHandler;
-
-class ProxyClientConnection : public mio::ConnectionWithOutput,
-    public std::enable_shared_from_this<ProxyClientConnection> {
+class ProxyClientRequestHandler {
 private:
-    ProxyClientConnection(std::shared_ptr<mio::ConnectionManager> connection_manager,
-            std::shared_ptr<mio::Socket> socket) :
-        ConnectionWithOutput(socket, 
-                nullptr,
-                std::make_shared<mio::AsyncWriter>(socket,
-                    std::make_shared<OutputBinaryProtocol>()), 
-                std::make_shared<mio::Closer>()) {
-        std::shared_ptr<ProxyClientConnection> this_ptr(this);
-        connection_manager->addConnection(this_ptr);
-        this_ptr->initReader(connection_manager, socket);
+    mio::pipeline::ConnectionBase &client_connection_;
+    ProxyContext &context_;
+    struct sockaddr_in peer_address_;
+
+    // access log and trace state of the last request on this connection
+    std::shared_ptr<UpstreamFetch> request_fetch_;
+    AccessLogRecord record_;
+    UpstreamFetch::Clock::time_point request_time_;
+    uint64_t request_bytes_written_;
+    uint64_t accept_ticks_;
+    uint64_t header_ticks_;
+
+    static constexpr uint64_t HEDGE_MIN_SAMPLES = 100;
+
+    // Connects one attempt of the fetch, to a server picked by health for
+    // routed requests and to host:80 otherwise.
+    static void startAttempt(ProxyContext &context,
+            const std::string &hostname,
+            const UpstreamRequest &request,
+            std::shared_ptr<UpstreamFetch> fetch,
+            const UpstreamHealth *avoid) {
+        Upstream upstream(hostname);
+        UpstreamHealth *health = nullptr;
+        if (request.route) {
+            health = &context.upstream_health.select(request.route->servers, avoid);
+            upstream = health->server();
+        }
+        MIOPROXY_TRACE(fetch->trace().markOnce(TRACE_ROUTE_DECIDED));
+        size_t attempt = fetch->addAttempt(upstream.host, upstream.port, health);
+
+        ProxyContext *context_ptr = &context;
+        std::weak_ptr<UpstreamFetch> weak_fetch = fetch;
+        resolveUpstream(context, upstream, [context_ptr, request, weak_fetch, attempt]
+                (std::shared_ptr<const UpstreamAddress> address) {
+            std::shared_ptr<UpstreamFetch> fetch = weak_fetch.lock();
+            if (fetch) {
+                connectAttempt(*context_ptr, address, request, fetch, attempt);
+            }
+        });
+    }
+
+    static void connectAttempt(ProxyContext &context,
+            std::shared_ptr<const UpstreamAddress> address,
+            const UpstreamRequest &request,
+            std::shared_ptr<UpstreamFetch> fetch,
+            size_t attempt) {
+        MIOPROXY_TRACE(fetch->trace().markOnce(TRACE_DNS_DONE));
+        if (!fetch->attemptWanted(attempt)) {
+            fetch->onAttemptClosed(attempt);
+            return;
+        }
+        try {
+            if (!address) {
+                throw std::runtime_error("Failed to get host by name");
+            }
+            const mio::SocketOptions &options = request.route ?
+                request.route->socket_options : request.routes->unroutedOptions();
+            auto new_connection = ProxyBackendConnection::create(context, *address, options,
+                    fetch, attempt);
+            if (!request.rewritten.empty()) {
+                new_connection->addOutput(request.rewritten);
+            } else {
+                new_connection->addOutput(request.buffer);
+            }
+
+        } catch (const std::runtime_error &exception) {
+            if (context.log) {
+                context.log->write(std::string("Failed to establish connection: ") +
+                        exception.what());
+            }
+            fetch->onAttemptClosed(attempt);
+        }
+    }
+
+    // Returns null if the fetch failed right away.
+    static std::shared_ptr<UpstreamFetch> startFetch(ProxyContext &context,
+            const std::string &hostname,
+            const UpstreamRequest &request,
+            std::shared_ptr<UpstreamFetch> fetch) {
+        const ProxyConfig &config = *context.config;
+        context.retry_budget.onRequest();
+        fetch->setBackpressure(config.max_client_buffered);
+
+        if (request.route) {
+            mio::Histogram &route_latency = context.route_latency[request.route->name];
+            fetch->setRouted(&context.upstream_health, &route_latency);
+
+            if (UpstreamFetch::isIdempotent(request.buffer)) {
+                ProxyContext *context_ptr = &context;
+                std::weak_ptr<UpstreamFetch> weak_fetch = fetch;
+                fetch->setRetries(config.retries, [context_ptr, hostname, request, weak_fetch]
+                        (const UpstreamHealth *avoid) {
+                    std::shared_ptr<UpstreamFetch> fetch = weak_fetch.lock();
+                    if (!fetch || !context_ptr->retry_budget.withdraw()) {
+                        return false;
+                    }
+                    startAttempt(*context_ptr, hostname, request, fetch, avoid);
+                    return true;
+                });
+
+                if (config.hedge_requests && route_latency.count() >= HEDGE_MIN_SAMPLES) {
+                    auto delay = std::max(config.hedge_min_delay, std::chrono::milliseconds
+                            (route_latency.quantile(0.95) / 1000));
+                    context.connection_manager->addTimer(delay, [weak_fetch]() {
+                        std::shared_ptr<UpstreamFetch> fetch = weak_fetch.lock();
+                        if (fetch) {
+                            fetch->hedge();
+                        }
+                    });
+                }
+            }
+        }
+
+        startAttempt(context, hostname, request, fetch, nullptr);
+        return fetch->finished() ? nullptr : fetch;
     }
 
-    void initReader(std::shared_ptr<mio::ConnectionManager> connection_manager,
-            std::shared_ptr<mio::Socket> socket) {
-        auto request_handler = std::make_shared<ProxyClientRequestHandler>
-            (connection_manager, shared_from_this());
+    // A follower whose fetch has not produced a byte within the coalescing
+    // timeout detaches from it and goes to the origin on its own.
+    void scheduleFallback(std::weak_ptr<UpstreamFetch> weak_fetch,
+            const std::string &hostname,
+            const UpstreamRequest &request) {
+        ProxyContext &context = context_;
+        mio::ConnectionHandle client = client_connection_.handle();
+        ProxyClientRequestHandler *handler = this;
 
-        reader_ = std::make_shared<mio::AsyncReader>(socket, 
-                std::make_shared<InputHttpProtocol>(request_handler));
+        context.connection_manager->addTimer(context.config->coalesce_timeout,
+                [&context, weak_fetch, client, handler, hostname, request]() {
+            std::shared_ptr<UpstreamFetch> fetch = weak_fetch.lock();
+            if (!fetch || fetch->started() || !context.connection_manager->find(client)) {
+                return;
+            }
+            if (fetch->removeClient(client)) {
+                auto own_fetch = std::make_shared<UpstreamFetch>(context.connection_manager.get());
+                own_fetch->addClient(client);
+                startFetch(context, hostname, request, own_fetch);
+                if (handler->request_fetch_ == fetch) {
+                    handler->trackFetch(own_fetch);
+                }
+            }
+        });
+    }
+
+    std::shared_ptr<UpstreamFetch> forwardRequest(const std::string &hostname,
+            const std::string &request_str,
+            const UpstreamRequest &request) {
+        mio::ConnectionHandle client = client_connection_.handle();
+        mio::ConnectionManager *connection_manager = context_.connection_manager.get();
+        const ProxyConfig &config = *context_.config;
+        bool cacheable = RequestCoalescer::isCoalescible(request_str);
+        std::string key = cacheable ? RequestCoalescer::makeKey(hostname, request_str) : "";
+
+        if (config.coalesce_requests && cacheable) {
+            std::shared_ptr<UpstreamFetch> fetch = context_.coalescer.find(key);
+            if (fetch) {
+                fetch->addClient(client);
+                if (!fetch->started()) {
+                    scheduleFallback(fetch, hostname, request);
+                }
+                return fetch;
+            }
+
+            fetch = std::make_shared<UpstreamFetch>(connection_manager);
+            fetch->setShared(&context_.coalescer, key, config.coalesce_max_buffered);
+            if (context_.disk_cache) {
+                fetch->setCached(context_.disk_cache.get(), key, config.disk_cache_ttl);
+            }
+            fetch->addClient(client);
+            if (startFetch(context_, hostname, request, fetch)) {
+                context_.coalescer.insert(key, fetch);
+            }
+            return fetch;
+        }
+
+        auto fetch = std::make_shared<UpstreamFetch>(connection_manager);
+        if (context_.disk_cache && cacheable) {
+            fetch->setCached(context_.disk_cache.get(), key, config.disk_cache_ttl);
+        }
+        fetch->addClient(client);
+        startFetch(context_, hostname, request, fetch);
+        return fetch;
+    }
+
+    void forward(const std::string &hostname,
+            const std::string &request_str,
+            const UpstreamRequest &request) {
+        trackFetch(forwardRequest(hostname, request_str, request));
+    }
+
+    // Makes fetch the one the current request is logged and traced with.
+    void trackFetch(std::shared_ptr<UpstreamFetch> fetch) {
+        if (context_.access_log || context_.config->trace_requests) {
+            request_fetch_ = fetch;
+            mio::ConnectionManager *connection_manager = context_.connection_manager.get();
+            mio::ConnectionHandle client = client_connection_.handle();
+            std::weak_ptr<UpstreamFetch> weak_fetch = fetch;
+            ProxyClientRequestHandler *handler = this;
+            fetch->notifyFinished([connection_manager, client, weak_fetch, handler]() {
+                if (connection_manager->find(client)) {
+                    handler->finishWhenWritten(weak_fetch);
+                }
+            });
+        }
+    }
+
+    // Reports the request of fetch once the last byte of its response has
+    // been written, unless a later request or the close reported it first.
+    // The waiter is kept by the connection, which owns this handler.
+    void finishWhenWritten(std::weak_ptr<UpstreamFetch> weak_fetch) {
+        ProxyClientRequestHandler *handler = this;
+        client_connection_.notifyDrained(0, [handler, weak_fetch]() {
+            if (handler->request_fetch_ && handler->request_fetch_ == weak_fetch.lock()) {
+                handler->finishRequest();
+            }
+        });
+    }
+
+    // Cacheable requests look in the disk cache first; the answer comes back
+    // on the reactor, possibly after this connection has gone away.
+    void lookupCache(const std::string &hostname,
+            const std::string &request_str,
+            const UpstreamRequest &request) {
+        mio::ConnectionManager *connection_manager = context_.connection_manager.get();
+        mio::ConnectionHandle client = client_connection_.handle();
+        ProxyClientRequestHandler *handler = this;
+
+        context_.disk_cache->lookup(RequestCoalescer::makeKey(hostname, request_str),
+                [connection_manager, client, handler, hostname, request_str, request]
+                (std::shared_ptr<DiskCacheHit> hit) {
+            if (!connection_manager->find(client)) {
+                return;
+            }
+            if (hit) {
+                handler->sendCached(hit);
+            } else {
+                handler->forward(hostname, request_str, request);
+            }
+        });
+    }
+
+    void sendCached(std::shared_ptr<DiskCacheHit> hit);
+
+    void beginRecord(const std::string &hostname) {
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        record_.timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+        record_.client_ip = peer_address_.sin_addr.s_addr;
+        record_.client_port = ntohs(peer_address_.sin_port);
+        AccessLogRecord::copyString(record_.host, hostname);
+        request_time_ = UpstreamFetch::Clock::now();
+        // what is still queued belongs to earlier responses
+        request_bytes_written_ = client_connection_.bytesWritten() +
+            client_connection_.queuedOutput();
+    }
+
+    void rejectRequest() {
+        static const char RESPONSE[] =
+            "HTTP/1.1 429 Too Many Requests\r\n"
+            "Content-Length: 0\r\n"
+            "Connection: close\r\n\r\n";
+        static const mio::Buffer response = mio::createBuffer(RESPONSE, RESPONSE + sizeof(RESPONSE) - 1);
+
+        client_connection_.addOutput(response);
+        client_connection_.setCloseAfterOutput();
+    }
+
+    static uint32_t toMicroseconds(UpstreamFetch::Clock::duration duration) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
     }
 
 public:
-    static std::shared_ptr<ProxyClientConnection> create
-        (std::weak_ptr<mio::ConnectionManager> connection_manager,
-         std::shared_ptr<mio::Socket> socket) {
-        std::shared_ptr<mio::ConnectionManager> conn_m = connection_manager.lock();
-
-        if (conn_m) {
-            return (new ProxyClientConnection(conn_m, socket))->shared_from_this();
-        } else {
-            return nullptr;
+    ProxyClientRequestHandler(mio::pipeline::ConnectionBase &client_connection,
+        ProxyContext &context,
+        const struct sockaddr_in &peer_address) :
+        client_connection_(client_connection),
+        context_(context),
+        peer_address_(peer_address),
+        request_fetch_(),
+        record_(),
+        request_time_(),
+        request_bytes_written_(0),
+        accept_ticks_(0),
+        header_ticks_(0) {
+        MIOPROXY_TRACE(accept_ticks_ = TraceClock::now());
+    }
+
+    void handleRequest(mio::Buffer request) {
+        if (!context_.client_limiter.allowRequest(context_.config->client_limits, peer_address_)) {
+            rejectRequest();
+            return;
         }
+
+        RequestHead head;
+        if (RequestHead::parse(mio::StringRef(request->data(), request->size()), head)) {
+            const ProxyConfig &config = *context_.config;
+            RouteTable::Match match = config.route_table->find(head.host, head.path);
+            std::string hostname = head.host.str();
+            std::string request_str(request->data(), request->data() + request->size());
+            finishRequest();
+            MIOPROXY_TRACE(header_ticks_ = TraceClock::now());
+            if (context_.access_log) {
+                beginRecord(hostname);
+            }
+
+            UpstreamRequest upstream_request = { request, mio::IoBuf(), config.route_table, match.route };
+            if (match.rules) {
+                upstream_request.rewritten = HeaderRewriter::rewrite(*match.rules, request,
+                        peer_address_);
+            }
+
+            if (context_.disk_cache && RequestCoalescer::isCoalescible(request_str)) {
+                lookupCache(hostname, request_str, upstream_request);
+            } else {
+                forward(hostname, request_str, upstream_request);
+            }
+        }
+    }
+
+    // Reports the last request to the access log and the phase histograms:
+    // when its response has been written, or failing that at the next
+    // request or the close.
+    void finishRequest() {
+        if (!request_fetch_) {
+            return;
+        }
+        if (context_.access_log) {
+            finishRecord();
+        }
+#if MIOPROXY_TRACING
+        const ProxyConfig &config = *context_.config;
+        if (config.trace_requests) {
+            RequestTrace trace = request_fetch_->trace();
+            trace.stamps[TRACE_ACCEPT] = accept_ticks_;
+            trace.stamps[TRACE_HEADER_COMPLETE] = header_ticks_;
+            trace.mark(TRACE_LAST_CLIENT_BYTE);
+            context_.tracer.record(trace, config.slow_request_threshold,
+                    config.slow_request_sample);
+        }
+        // later requests on a kept alive connection start at their header
+        accept_ticks_ = header_ticks_;
+#endif
+        request_fetch_.reset();
+    }
+
+    void finishRecord() {
+        record_.total_us = toMicroseconds(UpstreamFetch::Clock::now() - request_time_);
+        record_.upstream_us = toMicroseconds(request_fetch_->upstreamTime());
+        uint64_t written = client_connection_.bytesWritten();
+        record_.bytes_sent = written > request_bytes_written_ ? written - request_bytes_written_ : 0;
+        record_.status = request_fetch_->status();
+        record_.upstream_port = request_fetch_->upstreamPort();
+        record_.flags = (request_fetch_->shared() ? AccessLogRecord::COALESCED : 0) |
+            (request_fetch_->cacheHit() ? AccessLogRecord::CACHED : 0);
+        AccessLogRecord::copyString(record_.upstream, request_fetch_->upstreamHost());
+        context_.access_log->push(record_);
     }
 };
 
-class ProxyClientRequestHandler : public mio::RequestHandler {
+typedef mio::pipeline::Connection<
+        mio::pipeline::AsyncReader<pipeline::InputHttpProtocol<ProxyClientRequestHandler>>,
+        mio::pipeline::AsyncWriter<OutputBinaryProtocol>>
+    ProxyClientPipeline;
+
+class ProxyClientConnection : public ProxyClientPipeline {
 private:
-    std::weak_ptr<mio::ConnectionManager> connection_manager_;
-    std::weak_ptr<mio::Connection> client_connection_;
-    
+    ProxyContext &context_;
+    ClientLimiter::Key limit_key_;
+
 public:
-    explicit ProxyClientRequestHandler(std::weak_ptr<mio::ConnectionManager> connection_manager,
-        std::weak_ptr<mio::Connection> client_connection) :
-        connection_manager_(connection_manager),
-        client_connection_(client_connection)
-        {}
-   
-    virtual void handleRequest(mio::Buffer request) {
-        std::string request_str(request->data(), request->data() + request->size());
-        boost::smatch match;
-        boost::regex regex("Host: ([\\.a-zA-Z0-9-]*)");
-        if (boost::regex_search(request_str, match, regex)) {
-            auto hostname = match[1];
-            //std::cerr << "Request for host " << match[1] << std::endl;
-            try {
-                std::shared_ptr<mio::ConnectionManager> conn_m(connection_manager_.lock()); 
-                std::shared_ptr<mio::Connection> conn(client_connection_.lock());
-
-                auto new_connection = ProxyBackendConnection::create(conn_m, 
-                        hostname,
-                        conn); 
-                new_connection->addOutput(request);
-
-            } catch (const std::runtime_error &exception) {
-                std::cerr << "Failed to establish connection: " <<
-                    exception.what() << std::endl;
-            }
+    ProxyClientConnection(std::shared_ptr<mio::Socket> socket,
+            ProxyContext &context,
+            const struct sockaddr_in &peer_address,
+            ClientLimiter::Key limit_key) :
+        ProxyClientPipeline(context.arena, socket, context, peer_address),
+        context_(context),
+        limit_key_(limit_key) {
+        ++context_.client_connections;
+    }
+
+    virtual void onClose() {
+        --context_.client_connections;
+        context_.client_limiter.releaseConnection(limit_key_);
+        input_.protocol().handler().finishRequest();
+        ProxyClientPipeline::onClose();
+    }
+
+    static std::shared_ptr<ProxyClientConnection> create
+        (ProxyContext &context,
+         std::shared_ptr<mio::Socket> socket,
+         const struct sockaddr_in &peer_address,
+         ClientLimiter::Key limit_key) {
+        auto connection = mio::allocateShared<ProxyClientConnection>(context.arena, socket,
+                context, peer_address, limit_key);
+        if (context.capture) {
+            connection->startCapture(context.capture, mio::CaptureRecordHeader::CLIENT);
         }
+        context.connection_manager->addConnection(connection);
+        return connection;
     }
 };
 
+inline void ProxyClientRequestHandler::sendCached(std::shared_ptr<DiskCacheHit> hit) {
+    client_connection_.addOutput(context_.disk_cache->reader(hit));
+    client_connection_.setCloseAfterOutput();
+    if (context_.access_log || context_.config->trace_requests) {
+        request_fetch_ = std::make_shared<UpstreamFetch>(context_.connection_manager.get());
+        request_fetch_->setCacheHit();
+        finishWhenWritten(request_fetch_);
+    }
 }
+
+} // namespace mioproxy
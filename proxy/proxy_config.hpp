@@ -0,0 +1,338 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+#include "mio/io_server.hpp"
+#include "mio/socket_options.hpp"
+#include "mio/unix_address.hpp"
+#include "client_limiter.hpp"
+#include "disk_cache.hpp"
+#include "header_rewrite.hpp"
+#include "route_table.hpp"
+
+namespace mioproxy {
+
+// Everything in here except the listen address, the upgrade socket and the
+// access log file can be changed by a reload (SIGHUP).
+struct ProxyConfig {
+    // TCP "ip:port" or "unix:..." addresses
+    std::vector<mio::ServerConfig> listen;
+    // UNIX socket over which a newly started process takes over the listeners
+    std::string upgrade_socket;
+    // how long the old process keeps serving connections after a handoff
+    std::chrono::milliseconds drain_timeout;
+
+    // binary access log, see tools/access_log_dump; set at startup only
+    std::string access_log;
+    size_t access_log_max_bytes;
+    size_t access_log_ring_size;
+
+    // client connections beyond this are closed right after accept
+    size_t max_connections;
+
+    // per source address request rate and connection limits, most specific
+    // network first; the table size is set at startup only
+    std::vector<ClientLimitRule> client_limits;
+    size_t client_limit_table_size;
+
+    // collapse concurrent identical GETs into a single upstream fetch
+    bool coalesce_requests;
+    // how long a follower waits for the first byte before fetching on its own
+    std::chrono::milliseconds coalesce_timeout;
+    // response bytes kept to replay to followers that join late
+    size_t coalesce_max_buffered;
+    // response bytes queued for one client before the upstream is no
+    // longer read, 0 for no limit
+    size_t max_client_buffered;
+
+    // per phase latency histograms (dumped on SIGUSR1) and slow request log
+    bool trace_requests;
+    std::chrono::milliseconds slow_request_threshold;
+    // log one in this many slow requests, 0 disables the log
+    uint64_t slow_request_sample;
+
+    // on-disk response cache, off unless a directory is set; only the ttl
+    // for responses without max-age can be changed by a reload
+    DiskCacheConfig disk_cache;
+    int64_t disk_cache_ttl;
+
+    // upstream health: consecutive failures before a server is ejected,
+    // first and longest ejection, ramp up time after one
+    uint32_t eject_failures;
+    std::chrono::milliseconds eject_base;
+    std::chrono::milliseconds eject_max;
+    std::chrono::milliseconds slow_start;
+    // 0 disables connect probes to routed servers
+    std::chrono::milliseconds health_check_interval;
+    std::chrono::milliseconds connect_timeout;
+
+    // extra attempts for idempotent requests to routed hosts: retries after
+    // a failed connect or a close before any response, hedges after the
+    // route's p95 time to first byte; both capped at a share of traffic
+    uint32_t retries;
+    double retry_budget_percent;
+    bool hedge_requests;
+    std::chrono::milliseconds hedge_min_delay;
+
+    // startup only: records client and upstream byte streams for replay
+    std::string capture_file;
+
+    // bytes one connection may read or write per event before the loop
+    // moves on to other ready connections, 0 for no limit
+    size_t read_budget;
+    size_t write_budget;
+
+    // startup only: threads for DNS and disk cache reads
+    size_t offload_threads;
+
+    // startup only: connections and their sockets come from a per-reactor
+    // arena, optionally on huge pages
+    bool connection_arena;
+    bool arena_huge_pages;
+
+    // host[/path prefix] -> upstream servers, where host may be "*.domain";
+    // hosts without a route go to host:80
+    std::map<std::string, std::vector<Upstream>> routes;
+    // host -> request header edits; requests to other hosts are forwarded
+    // untouched
+    std::map<std::string, HeaderRules> header_rules;
+    // TCP socket options per listen address and per route key, "*" for
+    // all; listener options are set at startup only
+    std::map<std::string, mio::SocketOptions> listen_options;
+    std::map<std::string, mio::SocketOptions> upstream_options;
+    // routes, header_rules and upstream_options compiled for lookups,
+    // rebuilt by load()
+    std::shared_ptr<const RouteTable> route_table;
+
+    ProxyConfig() :
+        listen(1),
+        upgrade_socket(),
+        drain_timeout(30000),
+        access_log(),
+        access_log_max_bytes(1 << 30),
+        access_log_ring_size(1 << 16),
+        max_connections(100000),
+        client_limits(),
+        client_limit_table_size(1 << 16),
+        coalesce_requests(false),
+        coalesce_timeout(1000),
+        coalesce_max_buffered(1 << 20),
+        max_client_buffered(4 << 20),
+        trace_requests(true),
+        slow_request_threshold(1000),
+        slow_request_sample(10),
+        disk_cache(),
+        disk_cache_ttl(300),
+        eject_failures(5),
+        eject_base(1000),
+        eject_max(60000),
+        slow_start(10000),
+        health_check_interval(0),
+        connect_timeout(5000),
+        retries(1),
+        retry_budget_percent(20),
+        hedge_requests(false),
+        hedge_min_delay(5),
+        capture_file(),
+        read_budget(64 * 1024),
+        write_budget(256 * 1024),
+        offload_threads(4),
+        connection_arena(true),
+        arena_huge_pages(false),
+        routes(),
+        header_rules(),
+        listen_options(),
+        upstream_options(),
+        route_table(std::make_shared<RouteTable>())
+        {}
+
+    mio::SocketOptions listenOptions(const mio::ServerConfig &server) const {
+        mio::SocketOptions options;
+        auto defaults = listen_options.find("*");
+        if (defaults != listen_options.end()) {
+            options = defaults->second;
+        }
+        auto specific = listen_options.find(server.address + ":" + std::to_string(server.port));
+        if (specific != listen_options.end()) {
+            options = options.overriddenBy(specific->second);
+        }
+        return options;
+    }
+
+    // Line based "key value..." format, '#' starts a comment:
+    //
+    //   listen 127.0.0.1:8992 unix:/run/mio-proxy.http
+    //   upgrade_socket /run/mio-proxy.sock
+    //   coalesce_requests on
+    //   client_limit 10.0.0.0/8 100 200 50   # requests/s, burst, connections
+    //   route www.example.com 10.0.0.1:8080 10.0.0.2:8080
+    //   route *.example.com/static/ unix:/run/static.sock
+    //   rewrite www.example.com via mio-proxy
+    //   listen_options * nodelay=on defer_accept=5
+    //   upstream_options www.example.com nodelay=on fastopen=on
+    static ProxyConfig load(const std::string &path) {
+        std::ifstream file(path);
+        if (!file) {
+            throw std::runtime_error("Failed to open config " + path);
+        }
+
+        ProxyConfig config;
+        std::string line;
+        int line_number = 0;
+        while (std::getline(file, line)) {
+            ++line_number;
+            line = line.substr(0, line.find('#'));
+
+            std::istringstream words(line);
+            std::string key;
+            if (!(words >> key)) {
+                continue;
+            }
+            std::string value;
+            if (!(words >> value)) {
+                throw std::runtime_error("Missing value in " + path + ":" +
+                        std::to_string(line_number));
+            }
+            config.set(key, value, words);
+        }
+        ClientLimiter::sortRules(config.client_limits);
+        config.route_table = std::make_shared<RouteTable>(config.routes, config.header_rules,
+                config.upstream_options);
+        return config;
+    }
+
+private:
+    static bool parseFlag(const std::string &value) {
+        return value == "on" || value == "true" || value == "1";
+    }
+
+    void set(const std::string &key, const std::string &value, std::istringstream &rest) {
+        if (key == "listen") {
+            listen.clear();
+            std::string address = value;
+            do {
+                Upstream parsed = Upstream::parse(address);
+                mio::ServerConfig server;
+                server.address = parsed.host;
+                server.port = parsed.port;
+                listen.push_back(server);
+            } while (rest >> address);
+        } else if (key == "upgrade_socket") {
+            upgrade_socket = value;
+        } else if (key == "drain_timeout_ms") {
+            drain_timeout = std::chrono::milliseconds(std::stol(value));
+        } else if (key == "access_log") {
+            access_log = value;
+        } else if (key == "access_log_max_bytes") {
+            access_log_max_bytes = std::stoul(value);
+        } else if (key == "access_log_ring_size") {
+            access_log_ring_size = std::stoul(value);
+        } else if (key == "max_connections") {
+            max_connections = std::stoul(value);
+        } else if (key == "client_limit") {
+            double requests_per_second = 0;
+            double burst = 0;
+            uint32_t connections = 0;
+            if (!(rest >> requests_per_second >> burst >> connections)) {
+                throw std::runtime_error("client_limit needs a network, requests per "
+                        "second, burst and max connections");
+            }
+            client_limits.push_back(ClientLimitRule::parse(value,
+                        requests_per_second, burst, connections));
+        } else if (key == "client_limit_table_size") {
+            client_limit_table_size = std::stoul(value);
+        } else if (key == "coalesce_requests") {
+            coalesce_requests = parseFlag(value);
+        } else if (key == "coalesce_timeout_ms") {
+            coalesce_timeout = std::chrono::milliseconds(std::stol(value));
+        } else if (key == "coalesce_max_buffered") {
+            coalesce_max_buffered = std::stoul(value);
+        } else if (key == "max_client_buffered") {
+            max_client_buffered = std::stoul(value);
+        } else if (key == "trace_requests") {
+            trace_requests = parseFlag(value);
+        } else if (key == "slow_request_ms") {
+            slow_request_threshold = std::chrono::milliseconds(std::stol(value));
+        } else if (key == "slow_request_sample") {
+            slow_request_sample = std::stoull(value);
+        } else if (key == "disk_cache_dir") {
+            disk_cache.directory = value;
+        } else if (key == "disk_cache_index_entries") {
+            disk_cache.index_entries = std::stoul(value);
+        } else if (key == "disk_cache_slab_bytes") {
+            disk_cache.slab_bytes = std::stoul(value);
+        } else if (key == "disk_cache_slabs") {
+            disk_cache.max_slabs = std::stoul(value);
+        } else if (key == "disk_cache_max_object") {
+            disk_cache.max_object_bytes = std::stoul(value);
+        } else if (key == "disk_cache_ttl_s") {
+            disk_cache_ttl = std::stoll(value);
+        } else if (key == "eject_failures") {
+            eject_failures = std::max(1ul, std::stoul(value));
+        } else if (key == "eject_base_ms") {
+            eject_base = std::chrono::milliseconds(std::stol(value));
+        } else if (key == "eject_max_ms") {
+            eject_max = std::chrono::milliseconds(std::stol(value));
+        } else if (key == "slow_start_ms") {
+            slow_start = std::chrono::milliseconds(std::stol(value));
+        } else if (key == "health_check_interval_ms") {
+            health_check_interval = std::chrono::milliseconds(std::stol(value));
+        } else if (key == "connect_timeout_ms") {
+            connect_timeout = std::chrono::milliseconds(std::stol(value));
+        } else if (key == "retries") {
+            retries = std::stoul(value);
+        } else if (key == "retry_budget_percent") {
+            retry_budget_percent = std::stod(value);
+        } else if (key == "hedge_requests") {
+            hedge_requests = parseFlag(value);
+        } else if (key == "hedge_min_delay_ms") {
+            hedge_min_delay = std::chrono::milliseconds(std::stol(value));
+        } else if (key == "capture_file") {
+            capture_file = value;
+        } else if (key == "read_budget_bytes") {
+            read_budget = std::stoul(value);
+        } else if (key == "write_budget_bytes") {
+            write_budget = std::stoul(value);
+        } else if (key == "offload_threads") {
+            offload_threads = std::stoul(value);
+        } else if (key == "connection_arena") {
+            connection_arena = parseFlag(value);
+        } else if (key == "arena_huge_pages") {
+            arena_huge_pages = parseFlag(value);
+        } else if (key == "route") {
+            std::vector<Upstream> servers;
+            std::string upstream;
+            while (rest >> upstream) {
+                servers.push_back(Upstream::parse(upstream));
+            }
+            if (servers.empty()) {
+                throw std::runtime_error("route needs a host and an upstream");
+            }
+            routes[value] = servers;
+        } else if (key == "rewrite") {
+            std::string rule, rule_value;
+            if (!(rest >> rule)) {
+                throw std::runtime_error("rewrite needs a host and a rule");
+            }
+            rest >> rule_value;
+            header_rules[value].set(rule, rule_value);
+        } else if (key == "listen_options" || key == "upstream_options") {
+            mio::SocketOptions &options = key == "listen_options" ?
+                listen_options[value] : upstream_options[value];
+            std::string option;
+            while (rest >> option) {
+                options.set(option);
+            }
+        } else {
+            throw std::runtime_error("Unknown config key " + key);
+        }
+    }
+};
+
+} // namespace mioproxy
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <map>
+#include <string>
+
+#include "mio/mio.hpp"
+#include "mio/allocation_count.hpp"
+#include "mio/arena.hpp"
+#include "mio/completion_queue.hpp"
+#include "mio/histogram.hpp"
+#include "mio/offload_pool.hpp"
+#include "mio/traffic_capture.hpp"
+#include "proxy_config.hpp"
+#include "access_log.hpp"
+#include "diagnostic_log.hpp"
+#include "request_trace.hpp"
+#include "upstream_health.hpp"
+#include "retry_budget.hpp"
+#include "upstream_fetch.hpp"
+
+namespace mioproxy {
+
+// Allocations made while setting up connections of one kind.
+struct ConnectionAllocations {
+    uint64_t connections;
+    uint64_t heap;
+    uint64_t arena;
+
+    ConnectionAllocations() :
+        connections(0),
+        heap(0),
+        arena(0)
+        {}
+
+    void record(const mio::AllocationScope &heap_allocations, uint64_t arena_allocations) {
+        ++connections;
+        heap += heap_allocations.count();
+        arena += arena_allocations;
+    }
+};
+
+// Per reactor state shared by all proxy connections of that reactor.
+struct ProxyContext {
+    std::shared_ptr<mio::ConnectionManager> connection_manager;
+    // replaced as a whole on reload; since the reactor swaps it between two
+    // events, every request sees one consistent version
+    std::shared_ptr<const ProxyConfig> config;
+    RequestCoalescer coalescer;
+    // null when access logging is off
+    std::shared_ptr<AccessLogRing> access_log;
+    // messages for stderr, written off the reactor
+    std::shared_ptr<DiagnosticLog> log;
+    RequestTracer tracer;
+    ClientLimiter client_limiter;
+    UpstreamHealthTracker upstream_health;
+    RetryBudget retry_budget;
+    // time to first byte per routed host, for hedging
+    std::map<std::string, mio::Histogram> route_latency;
+    // results of work done on helper threads come back through here
+    std::shared_ptr<mio::CompletionQueue> completions;
+    // blocking work (DNS, disk cache reads) runs here
+    std::shared_ptr<mio::OffloadPool> offload;
+    // null when the disk cache is off
+    std::shared_ptr<DiskCache> disk_cache;
+    // null unless traffic is being captured
+    std::shared_ptr<mio::TrafficCapture> capture;
+    // connections and their sockets come from here; null when off
+    std::shared_ptr<mio::ArenaPool> arena;
+    ConnectionAllocations client_allocations;
+    ConnectionAllocations backend_allocations;
+    size_t client_connections;
+    size_t backend_connections;
+
+    ProxyContext(std::shared_ptr<mio::ConnectionManager> connection_manager,
+            std::shared_ptr<const ProxyConfig> config) :
+        connection_manager(connection_manager),
+        config(config),
+        coalescer(),
+        access_log(),
+        log(),
+        tracer(),
+        client_limiter(config->client_limit_table_size),
+        upstream_health(),
+        retry_budget(),
+        route_latency(),
+        completions(std::make_shared<mio::CompletionQueue>()),
+        offload(),
+        disk_cache(),
+        capture(),
+        arena(),
+        client_allocations(),
+        backend_allocations(),
+        client_connections(0),
+        backend_connections(0) {
+        upstream_health.configure(*config);
+        retry_budget.configure(config->retry_budget_percent);
+    }
+
+    uint64_t arenaAllocations() const {
+        return arena ? arena->allocations() : 0;
+    }
+};
+
+} // namespace mioproxy
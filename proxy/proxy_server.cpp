@@ -1,15 +1,18 @@
 #include <iostream>
+#include <sstream>
 #include <vector>
 #include <map>
 
-#include <boost/regex.hpp>
-
 #include "mio/io_server.hpp"
 #include "mio/mio.hpp"
 #include "mio/async_io.hpp"
 #include "mio/client_socket.hpp"
+#include "mio/pipeline.hpp"
+#include "mio/fd_handoff.hpp"
+#include "mio/signal_socket.hpp"
 
 #include "http_protocol.hpp"
+#include "proxy_context.hpp"
 #include "proxy_backend.hpp"
 #include "proxy_client.hpp"
 
@@ -18,22 +21,36 @@ namespace mioproxy {
 class ProxyServerAcceptor : public mio::Reader {
 private:
     std::shared_ptr<mio::ServerSocket> socket_;
-    std::weak_ptr<mio::ConnectionManager> connection_manager_;
+    ProxyContext &context_;
 
 public:
     ProxyServerAcceptor(std::shared_ptr<mio::ServerSocket> socket,
-            std::weak_ptr<mio::ConnectionManager> connection_manager) :
+            ProxyContext &context) :
 
         socket_(socket),
-        connection_manager_(connection_manager)
+        context_(context)
         {}
 
     bool read() {
         while (true) {
-            auto new_socket = socket_->acceptNewConnection();
-            std::shared_ptr<mio::ConnectionManager> con_m(connection_manager_.lock()); 
+            struct sockaddr_in peer_address;
+            mio::AllocationScope heap_allocations;
+            uint64_t arena_allocations = context_.arenaAllocations();
+            auto new_socket = socket_->acceptNewConnection(&peer_address, context_.arena);
             if (new_socket != nullptr) { 
-                ProxyClientConnection::create(con_m, new_socket);
+                // rejected sockets are closed here, before any other work
+                const ProxyConfig &config = *context_.config;
+                if (context_.client_connections >= config.max_connections) {
+                    continue;
+                }
+                ClientLimiter::Key limit_key;
+                if (!context_.client_limiter.acquireConnection(config.client_limits,
+                            peer_address, limit_key)) {
+                    continue;
+                }
+                ProxyClientConnection::create(context_, new_socket, peer_address, limit_key);
+                context_.client_allocations.record(heap_allocations,
+                        context_.arenaAllocations() - arena_allocations);
             } else {
                 break;
             }
@@ -42,30 +59,74 @@ public:
     }
 };
 
+// Hands the listening sockets to a newly started process.
+class ProxyHandoffAcceptor : public mio::Reader {
+private:
+    std::shared_ptr<mio::HandoffServerSocket> socket_;
+    std::function<void(int)> on_handoff_;
+
+public:
+    ProxyHandoffAcceptor(std::shared_ptr<mio::HandoffServerSocket> socket,
+            std::function<void(int)> on_handoff) :
+        socket_(socket),
+        on_handoff_(on_handoff)
+        {}
+
+    bool read() {
+        while (auto peer = socket_->acceptNewConnection()) {
+            on_handoff_(peer->getDescriptor());
+        }
+        return false;
+    }
+};
+
+class ProxySignalReader : public mio::Reader {
+private:
+    std::shared_ptr<mio::SignalSocket> socket_;
+    std::function<void(int)> on_signal_;
+
+public:
+    ProxySignalReader(std::shared_ptr<mio::SignalSocket> socket,
+            std::function<void(int)> on_signal) :
+        socket_(socket),
+        on_signal_(on_signal)
+        {}
+
+    bool read() {
+        while (int signal = socket_->readSignal()) {
+            on_signal_(signal);
+        }
+        return false;
+    }
+};
+
 class ProxyServerConnection : public mio::Connection,
     public std::enable_shared_from_this<ProxyServerConnection> {
 public:
     ProxyServerConnection(std::shared_ptr<mio::ConnectionManager> connection_manager,
-            std::shared_ptr<mio::ServerSocket> server_socket, 
+            std::shared_ptr<mio::Socket> socket, 
             std::shared_ptr<mio::Reader> reader) :
 
-        Connection(server_socket, reader, nullptr, nullptr) {
+        Connection(socket, reader, nullptr, nullptr) {
         std::shared_ptr<ProxyServerConnection> this_ptr(this); 
         connection_manager->addConnection(this_ptr);
     }
 
     static std::shared_ptr<ProxyServerConnection> create
-        (std::weak_ptr<mio::ConnectionManager> connection_manager,
+        (ProxyContext &context,
+         std::shared_ptr<mio::Socket> socket,
+         std::shared_ptr<mio::Reader> reader) {
+        return (new ProxyServerConnection(context.connection_manager, socket, reader))
+            ->shared_from_this();
+    }
+
+    static std::shared_ptr<ProxyServerConnection> create
+        (ProxyContext &context,
          std::shared_ptr<mio::ServerSocket> server_socket) {
 
         auto reader = std::make_shared<ProxyServerAcceptor>
-            (server_socket, connection_manager); 
-        std::shared_ptr<mio::ConnectionManager> conn_m = connection_manager.lock();
-        if (conn_m) {
-            return (new ProxyServerConnection(conn_m, server_socket, reader))->shared_from_this();
-        } else {
-            return nullptr;
-        }
+            (server_socket, context); 
+        return create(context, server_socket, reader);
     }
 
     virtual void addOutput(mio::Buffer output) {}
@@ -87,19 +148,313 @@ public:
         //std::unique_lock<std::mutex> lock(add_mutex_);
         return io_server_->addConnection(connection);
     }
+
+    virtual void addTimer(std::chrono::milliseconds delay, std::function<void()> callback) {
+        io_server_->addTimer(delay, callback);
+    }
+
+    virtual void removeConnection(std::shared_ptr<mio::Connection> connection) {
+        io_server_->removeConnection(connection);
+    }
+
+    virtual void pauseInput(std::shared_ptr<mio::Connection> connection, bool paused) {
+        io_server_->pauseInput(connection, paused);
+    }
+
+    virtual mio::Connection *find(mio::ConnectionHandle handle) {
+        return io_server_->find(handle);
+    }
 };
 
 class ProxyServer {
 private:
+    typedef std::chrono::steady_clock Clock;
+
+    static constexpr int DRAIN_CHECK_MS = 100;
+    static constexpr int HEALTH_CHECK_IDLE_MS = 1000;
+
     std::shared_ptr<mio::IOServer<mio::EpollDescriptorManager>> io_server_;
-    std::shared_ptr<mio::ConnectionManager> connection_manager_;
+    ProxyContext context_;
+    std::string config_path_;
+    std::unique_ptr<AccessLogWriter> access_log_writer_;
+
+    std::vector<std::shared_ptr<mio::ServerSocket>> server_sockets_;
+    std::vector<std::shared_ptr<mio::Connection>> listeners_;
+    bool draining_;
+    Clock::time_point drain_deadline_;
+    // only the newest reload is applied when several finish out of order
+    uint64_t reloads_;
+
+    void listen(const ProxyConfig &config) {
+        std::vector<int> inherited;
+        if (!config.upgrade_socket.empty()) {
+            inherited = mio::receiveDescriptors(config.upgrade_socket);
+        }
+
+        if (inherited.empty()) {
+            for (auto &listen : config.listen) {
+                if (mio::UnixAddress::isUnixAddress(listen.address)) {
+                    server_sockets_.push_back(std::make_shared<mio::ServerSocket>
+                            (mio::UnixAddress::parse(listen.address)));
+                } else {
+                    server_sockets_.push_back(std::make_shared<mio::ServerSocket>
+                            (listen.address, listen.port, true, config.listenOptions(listen)));
+                }
+            }
+        } else {
+            for (int fd : inherited) {
+                server_sockets_.push_back(std::make_shared<mio::ServerSocket>(fd));
+            }
+        }
+
+        for (auto &server_socket : server_sockets_) {
+            listeners_.push_back(ProxyServerConnection::create(context_, server_socket));
+        }
+
+        if (!config.upgrade_socket.empty()) {
+            auto handoff_socket = std::make_shared<mio::HandoffServerSocket>
+                (config.upgrade_socket);
+            listeners_.push_back(ProxyServerConnection::create(context_, handoff_socket,
+                    std::make_shared<ProxyHandoffAcceptor>(handoff_socket,
+                        [this](int peer) { handOff(peer); })));
+        }
+    }
+
+    void handOff(int peer) {
+        std::vector<int> fds;
+        for (auto &server_socket : server_sockets_) {
+            fds.push_back(server_socket->getDescriptor());
+        }
+        mio::sendDescriptors(peer, fds);
+        drain();
+    }
+
+    // Stops accepting and lets open connections finish until the deadline.
+    void drain() {
+        if (draining_) {
+            return;
+        }
+        draining_ = true;
+        drain_deadline_ = Clock::now() + context_.config->drain_timeout;
+
+        for (auto &listener : listeners_) {
+            io_server_->removeConnection(listener);
+        }
+        listeners_.clear();
+        server_sockets_.clear();
+        checkDrained();
+    }
+
+    void checkDrained() {
+        if ((context_.client_connections == 0 && context_.backend_connections == 0) ||
+                Clock::now() >= drain_deadline_) {
+            io_server_->stop();
+            return;
+        }
+        io_server_->addTimer(std::chrono::milliseconds(DRAIN_CHECK_MS),
+                [this]() { checkDrained(); });
+    }
+
+    // Parsing the file and compiling the route table take long enough with
+    // many hosts to stall every connection, so they run on the offload
+    // pool and the result is swapped in on the reactor.
+    void reload() {
+        if (config_path_.empty()) {
+            return;
+        }
+        uint64_t reload = ++reloads_;
+        std::string path = config_path_;
+        context_.offload->submit(context_.completions, [this, reload, path]() {
+            std::shared_ptr<ProxyConfig> config;
+            std::string error;
+            try {
+                config = std::make_shared<ProxyConfig>(ProxyConfig::load(path));
+            } catch (const std::exception &exception) {
+                error = exception.what();
+            }
+            return std::function<void()>([this, reload, config, error]() {
+                if (!config) {
+                    context_.log->write("Failed to reload config: " + error);
+                } else if (reload == reloads_) {
+                    applyConfig(config);
+                }
+            });
+        });
+    }
+
+    void applyConfig(std::shared_ptr<ProxyConfig> config) {
+        try {
+            // these are bound to the listeners and stay until the next upgrade
+            config->listen = context_.config->listen;
+            config->listen_options = context_.config->listen_options;
+            config->upgrade_socket = context_.config->upgrade_socket;
+            config->access_log = context_.config->access_log;
+            config->client_limit_table_size = context_.config->client_limit_table_size;
+            config->disk_cache = context_.config->disk_cache;
+            config->capture_file = context_.config->capture_file;
+            config->offload_threads = context_.config->offload_threads;
+            config->connection_arena = context_.config->connection_arena;
+            config->arena_huge_pages = context_.config->arena_huge_pages;
+            // freeing a big table takes as long as building it; requests
+            // still routed by the old one may hold it a while longer
+            std::shared_ptr<const ProxyConfig> old_config = context_.config;
+            context_.config = config;
+            context_.offload->submit(nullptr, [old_config]() mutable {
+                old_config.reset();
+                return std::function<void()>();
+            });
+            context_.upstream_health.configure(*config);
+            context_.retry_budget.configure(config->retry_budget_percent);
+            io_server_->setBudgets(config->read_budget, config->write_budget);
+        } catch (const std::exception &exception) {
+            context_.log->write(std::string("Failed to reload config: ") + exception.what());
+        }
+    }
+
+    // Written as one entry of the diagnostic log, so that a blocked stderr
+    // does not hold up the reactor either.
+    void dumpStats() {
+        std::ostringstream stream;
+        stream << "client connections " << context_.client_connections
+            << ", backend connections " << context_.backend_connections << '\n';
+        stream << "budget yields " << io_server_->budgetYields() << '\n';
+        stream << "rejected connections " << context_.client_limiter.rejectedConnections()
+            << ", rejected requests " << context_.client_limiter.rejectedRequests() << '\n';
+        if (context_.capture) {
+            stream << "capture records dropped " << context_.capture->dropped() << '\n';
+        }
+        if (access_log_writer_) {
+            stream << "access log records dropped " << access_log_writer_->dropped()
+                << ", lost to write errors " << access_log_writer_->failed() << '\n';
+        }
+        stream << "log lines dropped " << context_.log->dropped() << '\n';
+        dumpOffloadStats(stream);
+        dumpAllocationStats(stream);
+        context_.upstream_health.dump(stream);
+        stream << "extra upstream attempts " << context_.retry_budget.spent()
+            << ", denied by retry budget " << context_.retry_budget.denied() << '\n';
+        context_.tracer.dump(stream);
+        std::string text = stream.str();
+        text.pop_back();
+        context_.log->write(text);
+    }
+
+    void dumpOffloadStats(std::ostream &stream) {
+        mio::OffloadPool::Stats offload = context_.offload->stats();
+        stream << "offload threads " << context_.offload->threads()
+            << ", busy " << offload.busy
+            << ", queued " << offload.queued << " (max " << offload.max_queued << ")"
+            << ", jobs " << offload.completed << "/" << offload.submitted << '\n';
+        stream << "offload wait us p50 " << offload.wait_us.quantile(0.5)
+            << " p99 " << offload.wait_us.quantile(0.99)
+            << ", run us p50 " << offload.run_us.quantile(0.5)
+            << " p99 " << offload.run_us.quantile(0.99) << '\n';
+        const mio::CompletionQueue &completions = *context_.completions;
+        stream << "completions " << completions.delivered()
+            << " in " << completions.batches() << " batches (largest "
+            << completions.largestBatch() << "), delay us p99 "
+            << completions.delay().quantile(0.99) << '\n';
+    }
+
+    static void dumpConnectionAllocations(std::ostream &stream, const char *kind,
+            const ConnectionAllocations &allocations) {
+        double connections = allocations.connections ? allocations.connections : 1;
+        stream << "allocations per " << kind << " connection: heap "
+            << allocations.heap / connections << ", arena "
+            << allocations.arena / connections
+            << " (" << allocations.connections << " connections)\n";
+    }
+
+    void dumpAllocationStats(std::ostream &stream) {
+        dumpConnectionAllocations(stream, "client", context_.client_allocations);
+        dumpConnectionAllocations(stream, "backend", context_.backend_allocations);
+        if (context_.arena) {
+            mio::ArenaPool::Stats arena = context_.arena->stats();
+            stream << "arena slots in use " << arena.slots_in_use
+                << ", allocations " << arena.allocations
+                << ", frees " << arena.frees << " (" << arena.remote_frees << " remote)"
+                << ", too large " << arena.fallbacks
+                << ", slabs " << arena.slabs << " (" << arena.huge_slabs << " huge)"
+                << '\n';
+        }
+    }
+
+    // Connect probes to every routed server, rescheduled from the current
+    // config so that a reload can turn them on or off.
+    void checkHealth() {
+        auto interval = context_.config->health_check_interval;
+        if (draining_) {
+            return;
+        }
+        if (interval.count() != 0) {
+            for (auto &route : context_.config->routes) {
+                for (auto &server : route.second) {
+                    HealthProbeConnection::create(context_, context_.upstream_health.get(server));
+                }
+            }
+        }
+        io_server_->addTimer(interval.count() != 0 ? interval :
+                std::chrono::milliseconds(HEALTH_CHECK_IDLE_MS), [this]() { checkHealth(); });
+    }
+
+    void onSignal(int signal) {
+        if (signal == SIGHUP) {
+            reload();
+        } else if (signal == SIGUSR1) {
+            dumpStats();
+        } else {
+            drain();
+        }
+    }
 
 public:
-    explicit ProxyServer(mio::ServerConfig config = mio::ServerConfig()) :
+    explicit ProxyServer(ProxyConfig config = ProxyConfig(),
+            std::string config_path = std::string()) :
         io_server_(std::make_shared<mio::IOServer<mio::EpollDescriptorManager>>()),
-        connection_manager_(std::make_shared<LockConnectionManager>(io_server_)) {
-            ProxyServerConnection::create(connection_manager_,
-                    std::make_shared<mio::ServerSocket>(config.address, config.port));
+        context_(std::make_shared<LockConnectionManager>(io_server_),
+                std::make_shared<ProxyConfig>(config)),
+        config_path_(config_path),
+        access_log_writer_(),
+        server_sockets_(),
+        listeners_(),
+        draining_(false),
+        drain_deadline_(),
+        reloads_(0) {
+        TraceClock::start();
+        io_server_->setBudgets(config.read_budget, config.write_budget);
+        // signals are blocked before any helper thread starts, so that they
+        // are only ever delivered through the signalfd
+        auto signal_socket = std::make_shared<mio::SignalSocket>
+            (std::initializer_list<int>{SIGHUP, SIGUSR1, SIGTERM, SIGINT});
+        // a write to a client that reset fails with EPIPE instead
+        ::signal(SIGPIPE, SIG_IGN);
+        ProxyServerConnection::create(context_, signal_socket,
+                std::make_shared<ProxySignalReader>(signal_socket,
+                    [this](int signal) { onSignal(signal); }));
+        ProxyServerConnection::create(context_, context_.completions->getSocket(),
+                std::make_shared<mio::CompletionReader>(context_.completions));
+
+        context_.offload = std::make_shared<mio::OffloadPool>(config.offload_threads);
+        context_.log = std::make_shared<DiagnosticLog>();
+        context_.tracer.setLog(context_.log);
+        context_.upstream_health.setLog(context_.log);
+        if (config.connection_arena) {
+            context_.arena = std::make_shared<mio::ArenaPool>(config.arena_huge_pages);
+        }
+        if (!config.capture_file.empty()) {
+            context_.capture = std::make_shared<mio::TrafficCapture>(config.capture_file);
+        }
+        if (!config.disk_cache.directory.empty()) {
+            context_.disk_cache = std::make_shared<DiskCache>(config.disk_cache,
+                    context_.completions, context_.offload);
+        }
+        if (!config.access_log.empty()) {
+            access_log_writer_.reset(new AccessLogWriter(config.access_log,
+                        config.access_log_max_bytes, config.access_log_ring_size));
+            context_.access_log = access_log_writer_->addRing();
+        }
+        listen(config);
+        checkHealth();
     }
 
     void run() {
@@ -109,9 +464,32 @@ public:
 
 } // namespace mioproxy
 
-int main() {
+// Counts heap allocations per thread, for the allocations per connection
+// in the SIGUSR1 stats. Out of line, so that the compiler does not see
+// free() meet a pointer from operator new at inlined call sites.
+__attribute__((noinline)) void *operator new(size_t size) {
+    ++mio::heapAllocations();
+    void *pointer = malloc(size == 0 ? 1 : size);
+    if (!pointer) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+__attribute__((noinline)) void operator delete(void *pointer) noexcept {
+    free(pointer);
+}
+
+int main(int argc, char **argv) {
     try {
-        mioproxy::ProxyServer proxy_server;
+        mioproxy::ProxyConfig config;
+        std::string config_path;
+        if (argc > 1) {
+            config_path = argv[1];
+            config = mioproxy::ProxyConfig::load(config_path);
+        }
+
+        mioproxy::ProxyServer proxy_server(config, config_path);
         proxy_server.run();
     } catch(const std::exception &ex) {
         std::cerr << ex.what() << std::endl;
@@ -119,4 +497,3 @@ int main() {
     }
     return 0;
 }
-
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+
+#include <stdint.h>
+#include <time.h>
+
+#include "mio/histogram.hpp"
+#include "diagnostic_log.hpp"
+
+// Request phase tracing is compiled in unless built with -DMIOPROXY_TRACING=0,
+// in which case every MIOPROXY_TRACE statement disappears.
+#ifndef MIOPROXY_TRACING
+#define MIOPROXY_TRACING 1
+#endif
+
+#if MIOPROXY_TRACING
+#define MIOPROXY_TRACE(statement) do { statement; } while (0)
+#else
+#define MIOPROXY_TRACE(statement) do {} while (0)
+#endif
+
+namespace mioproxy {
+
+// Cheap monotonic timestamps: the TSC on x86-64, CLOCK_MONOTONIC elsewhere.
+// Ticks are converted to nanoseconds only when a trace is finished, using
+// the rate observed since the process started, so no calibration loop is
+// needed at startup.
+class TraceClock {
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Origin {
+        uint64_t ticks;
+        Clock::time_point time;
+
+        Origin() :
+            ticks(TraceClock::now()),
+            time(Clock::now())
+            {}
+    };
+
+    static const Origin &origin() {
+        static Origin origin;
+        return origin;
+    }
+
+public:
+    static uint64_t now() {
+#if defined(__x86_64__)
+        uint32_t low, high;
+        __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+        return (uint64_t(high) << 32) | low;
+#else
+        struct timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return uint64_t(time.tv_sec) * 1000000000 + time.tv_nsec;
+#endif
+    }
+
+    static double nanosecondsPerTick() {
+#if defined(__x86_64__)
+        const Origin &start = origin();
+        uint64_t ticks = now() - start.ticks;
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>
+            (Clock::now() - start.time).count();
+        return ticks == 0 ? 1.0 : double(elapsed) / ticks;
+#else
+        return 1.0;
+#endif
+    }
+
+    // call once at startup so that the rate is measured from there
+    static void start() {
+        origin();
+    }
+};
+
+enum TracePhase {
+    TRACE_ACCEPT,
+    TRACE_HEADER_COMPLETE,
+    TRACE_ROUTE_DECIDED,
+    TRACE_DNS_DONE,
+    TRACE_CONNECT_DONE,
+    TRACE_FIRST_UPSTREAM_BYTE,
+    TRACE_LAST_UPSTREAM_BYTE,
+    TRACE_LAST_CLIENT_BYTE,
+    TRACE_PHASE_COUNT
+};
+
+struct RequestTrace {
+    uint64_t stamps[TRACE_PHASE_COUNT];
+
+    RequestTrace() {
+        memset(stamps, 0, sizeof(stamps));
+    }
+
+    void mark(TracePhase phase) {
+        stamps[phase] = TraceClock::now();
+    }
+
+    void markOnce(TracePhase phase) {
+        if (stamps[phase] == 0) {
+            mark(phase);
+        }
+    }
+};
+
+// Per reactor phase histograms plus a sampled log of slow requests, which
+// goes to the log given to setLog (none without one). Every phase is
+// measured from the previous phase that was stamped.
+class RequestTracer {
+private:
+    static const char *phaseName(size_t phase) {
+        static const char *names[TRACE_PHASE_COUNT] = {
+            "accept", "header", "route", "dns", "connect",
+            "first_byte", "last_byte", "client_done"
+        };
+        return names[phase];
+    }
+
+    mio::Histogram phases_[TRACE_PHASE_COUNT];
+    mio::Histogram total_;
+    uint64_t slow_requests_;
+    std::shared_ptr<DiagnosticLog> log_;
+
+public:
+    RequestTracer() :
+        total_(),
+        slow_requests_(0),
+        log_()
+        {}
+
+    void setLog(std::shared_ptr<DiagnosticLog> log) {
+        log_ = log;
+    }
+
+    void record(const RequestTrace &trace,
+            std::chrono::milliseconds slow_threshold,
+            uint64_t slow_sample) {
+        double scale = TraceClock::nanosecondsPerTick();
+        uint64_t durations[TRACE_PHASE_COUNT] = { 0 };
+        uint64_t previous = trace.stamps[TRACE_ACCEPT];
+        for (size_t phase = TRACE_ACCEPT + 1; phase < TRACE_PHASE_COUNT; ++phase) {
+            uint64_t stamp = trace.stamps[phase];
+            if (stamp == 0) {
+                continue;
+            }
+            // followers of a coalesced fetch may see upstream phases that
+            // happened before their own request arrived
+            durations[phase] = stamp > previous ? uint64_t((stamp - previous) * scale) : 0;
+            phases_[phase].record(durations[phase]);
+            previous = std::max(previous, stamp);
+        }
+        uint64_t total = uint64_t((previous - trace.stamps[TRACE_ACCEPT]) * scale);
+        total_.record(total);
+
+        if (log_ && total >= uint64_t(slow_threshold.count()) * 1000000 &&
+                slow_sample != 0 && slow_requests_++ % slow_sample == 0) {
+            std::ostringstream line;
+            line << "slow request " << total / 1000 << "us:";
+            for (size_t phase = TRACE_ACCEPT + 1; phase < TRACE_PHASE_COUNT; ++phase) {
+                line << ' ' << phaseName(phase) << '=' << durations[phase] / 1000;
+            }
+            log_->write(line.str());
+        }
+    }
+
+    const mio::Histogram &phase(TracePhase phase) const {
+        return phases_[phase];
+    }
+
+    void dump(std::ostream &stream) const {
+        stream << std::left << std::setw(12) << "phase(us)"
+            << std::setw(10) << "count" << std::setw(10) << "mean"
+            << std::setw(10) << "p50" << std::setw(10) << "p99" << '\n';
+        for (size_t phase = TRACE_ACCEPT + 1; phase <= TRACE_PHASE_COUNT; ++phase) {
+            const mio::Histogram &histogram =
+                phase == TRACE_PHASE_COUNT ? total_ : phases_[phase];
+            stream << std::setw(12) << (phase == TRACE_PHASE_COUNT ? "total" : phaseName(phase))
+                << std::setw(10) << histogram.count()
+                << std::setw(10) << histogram.mean() / 1000
+                << std::setw(10) << histogram.quantile(0.5) / 1000
+                << std::setw(10) << histogram.quantile(0.99) / 1000 << '\n';
+        }
+        stream << std::right;
+    }
+};
+
+} // namespace mioproxy
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <algorithm>
+
+#include <stdint.h>
+
+namespace mioproxy {
+
+// Caps retries and hedges at a share of the request rate. Every request
+// deposits percent/100 of a token, every extra attempt spends one; the
+// balance is capped so that a quiet period can not bank a retry storm.
+// One budget per reactor.
+class RetryBudget {
+private:
+    static constexpr double MAX_BALANCE = 10.0;
+
+    double deposit_;
+    double balance_;
+    uint64_t spent_;
+    uint64_t denied_;
+
+public:
+    RetryBudget() :
+        deposit_(0.2),
+        balance_(MAX_BALANCE),
+        spent_(0),
+        denied_(0)
+        {}
+
+    void configure(double percent) {
+        deposit_ = percent / 100.0;
+    }
+
+    void onRequest() {
+        balance_ = std::min(MAX_BALANCE, balance_ + deposit_);
+    }
+
+    bool withdraw() {
+        if (balance_ < 1.0) {
+            ++denied_;
+            return false;
+        }
+        balance_ -= 1.0;
+        ++spent_;
+        return true;
+    }
+
+    uint64_t spent() const {
+        return spent_;
+    }
+
+    uint64_t denied() const {
+        return denied_;
+    }
+};
+
+} // namespace mioproxy
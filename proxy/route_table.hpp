@@ -0,0 +1,500 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+#include "mio/mio.hpp"
+#include "mio/io_buf.hpp"
+#include "mio/socket_options.hpp"
+#include "mio/string_ref.hpp"
+#include "mio/unix_address.hpp"
+#include "header_rewrite.hpp"
+
+namespace mioproxy {
+
+struct Upstream {
+    static constexpr int WEB_PORT = 80;
+
+    std::string host;
+    int port;
+    // only set by parse(), so a Host header never names a UNIX socket
+    bool unix_socket;
+
+    Upstream() :
+        host(),
+        port(WEB_PORT),
+        unix_socket(false)
+        {}
+
+    Upstream(std::string host, int port = WEB_PORT) :
+        host(host),
+        port(port),
+        unix_socket(false)
+        {}
+
+    // UNIX socket servers keep their "unix:..." address in host
+    bool isUnix() const {
+        return unix_socket;
+    }
+
+    std::string name() const {
+        return isUnix() ? host : host + ":" + std::to_string(port);
+    }
+
+    // "host", "host:port", "unix:/path" or "unix:@name"
+    static Upstream parse(const std::string &address) {
+        if (mio::UnixAddress::isUnixAddress(address)) {
+            mio::UnixAddress::parse(address);
+            Upstream upstream(address, 0);
+            upstream.unix_socket = true;
+            return upstream;
+        }
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos) {
+            return Upstream(address);
+        }
+        return Upstream(address.substr(0, colon), std::stoi(address.substr(colon + 1)));
+    }
+};
+
+// A server list from the config, under the name it was written with.
+struct Route {
+    std::string name;
+    std::vector<Upstream> servers;
+    mio::SocketOptions socket_options;
+};
+
+// Minimal perfect hash over a fixed key set (hash and displace): keys fall
+// into buckets by one hash, and each bucket gets the first seed for which
+// a second hash sends all its keys to slots nobody else has. A lookup is
+// two hashes and one comparison by the caller. Keys are ASCII
+// case-insensitive.
+class PerfectHash {
+private:
+    static constexpr uint32_t MAX_SEED = 1 << 24;
+
+    std::vector<uint32_t> seeds_;
+    size_t size_;
+
+    static uint64_t hash(mio::StringRef key, uint64_t seed) {
+        uint64_t hash = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+        for (size_t i = 0; i < key.size(); ++i) {
+            char c = key[i];
+            hash = (hash ^ uint8_t(c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c)) *
+                0x100000001b3ULL;
+        }
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+public:
+    PerfectHash() :
+        seeds_(),
+        size_(0)
+        {}
+
+    // keys must be distinct, ignoring case
+    explicit PerfectHash(const std::vector<std::string> &keys) :
+        seeds_(),
+        size_(keys.size()) {
+        if (size_ == 0) {
+            return;
+        }
+        std::vector<std::vector<uint32_t>> buckets((size_ + 1) / 2);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            buckets[hash(keys[i], 0) % buckets.size()].push_back(i);
+        }
+        std::vector<uint32_t> order(buckets.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b) {
+            return buckets[a].size() > buckets[b].size();
+        });
+
+        seeds_.assign(buckets.size(), 0);
+        std::vector<bool> taken(size_, false);
+        std::vector<size_t> slots;
+        for (uint32_t bucket : order) {
+            if (buckets[bucket].empty()) {
+                break;
+            }
+            uint32_t seed = 1;
+            for (; seed < MAX_SEED; ++seed) {
+                slots.clear();
+                for (uint32_t key : buckets[bucket]) {
+                    size_t slot = hash(keys[key], seed) % size_;
+                    if (taken[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+                        break;
+                    }
+                    slots.push_back(slot);
+                }
+                if (slots.size() == buckets[bucket].size()) {
+                    break;
+                }
+            }
+            if (seed == MAX_SEED) {
+                throw std::runtime_error("Failed to build host hash");
+            }
+            seeds_[bucket] = seed;
+            for (size_t slot : slots) {
+                taken[slot] = true;
+            }
+        }
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    // Slot of key if it is one of the keys, some slot otherwise.
+    size_t find(mio::StringRef key) const {
+        return hash(key, seeds_[hash(key, 0) % seeds_.size()]) % size_;
+    }
+};
+
+// Wildcard domains stored by labels from the right, so that
+// "*.example.com" is the path com -> example. A lookup walks the host's
+// labels the same way and keeps the deepest wildcard that still leaves a
+// label over: "*.example.com" matches "a.example.com" and
+// "a.b.example.com", but not "example.com". A host may be written fully
+// qualified, with a trailing dot.
+class SuffixTrie {
+private:
+    struct Node {
+        std::vector<std::pair<std::string, uint32_t>> children;    // sorted
+        int value;
+    };
+
+    std::vector<Node> nodes_;
+
+    int findChild(uint32_t node, mio::StringRef label) const {
+        auto &children = nodes_[node].children;
+        size_t low = 0;
+        size_t high = children.size();
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            int order = label.compareIgnoreCase(children[middle].first);
+            if (order == 0) {
+                return children[middle].second;
+            }
+            if (order < 0) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+        return -1;
+    }
+
+public:
+    SuffixTrie() :
+        nodes_(1, Node{ {}, -1 })
+        {}
+
+    // suffix is lowercase, without the "*."
+    void insert(const std::string &suffix, int value) {
+        uint32_t node = 0;
+        size_t end = suffix.size();
+        while (true) {
+            size_t dot = end == 0 ? std::string::npos : suffix.rfind('.', end - 1);
+            size_t begin = dot == std::string::npos ? 0 : dot + 1;
+            std::string label = suffix.substr(begin, end - begin);
+
+            int child = findChild(node, label);
+            if (child < 0) {
+                child = nodes_.size();
+                nodes_.push_back(Node{ {}, -1 });
+                auto &children = nodes_[node].children;
+                auto position = std::lower_bound(children.begin(), children.end(),
+                        std::make_pair(label, uint32_t(0)));
+                children.insert(position, std::make_pair(label, uint32_t(child)));
+            }
+            node = child;
+            if (dot == std::string::npos) {
+                break;
+            }
+            end = dot;
+        }
+        nodes_[node].value = value;
+    }
+
+    int find(mio::StringRef host) const {
+        int best = -1;
+        uint32_t node = 0;
+        size_t end = host.size();
+        if (end > 0 && host[end - 1] == '.') {
+            --end;
+        }
+        while (end > 0) {
+            size_t dot = host.rfind('.', end - 1);
+            size_t begin = dot == mio::StringRef::npos ? 0 : dot + 1;
+            int child = findChild(node, host.substr(begin, end - begin));
+            if (child < 0 || dot == mio::StringRef::npos) {
+                break;
+            }
+            node = child;
+            if (nodes_[node].value >= 0) {
+                best = nodes_[node].value;
+            }
+            end = dot;
+        }
+        return best;
+    }
+};
+
+// Radix tree of path prefixes; find() returns the value of the longest
+// prefix of the path that was inserted. Case-sensitive, like paths.
+class PrefixTree {
+private:
+    struct Node {
+        std::string edge;
+        std::vector<uint32_t> children;
+        int value;
+    };
+
+    std::vector<Node> nodes_;
+
+    int findChild(uint32_t node, char first) const {
+        for (uint32_t child : nodes_[node].children) {
+            if (nodes_[child].edge[0] == first) {
+                return child;
+            }
+        }
+        return -1;
+    }
+
+public:
+    PrefixTree() :
+        nodes_(1, Node{ std::string(), {}, -1 })
+        {}
+
+    bool empty() const {
+        return nodes_.size() == 1;
+    }
+
+    void insert(std::string prefix, int value) {
+        uint32_t node = 0;
+        while (!prefix.empty()) {
+            int child = findChild(node, prefix[0]);
+            if (child < 0) {
+                uint32_t added = nodes_.size();
+                nodes_.push_back(Node{ prefix, {}, -1 });
+                nodes_[node].children.push_back(added);
+                node = added;
+                prefix.clear();
+                break;
+            }
+            const std::string &edge = nodes_[child].edge;
+            size_t common = 0;
+            while (common < edge.size() && common < prefix.size() &&
+                    edge[common] == prefix[common]) {
+                ++common;
+            }
+            if (common < edge.size()) {
+                // split the edge where the new prefix leaves it
+                uint32_t middle = nodes_.size();
+                nodes_.push_back(Node{ edge.substr(0, common), { uint32_t(child) }, -1 });
+                nodes_[child].edge = nodes_[child].edge.substr(common);
+                std::replace(nodes_[node].children.begin(), nodes_[node].children.end(),
+                        uint32_t(child), middle);
+                child = middle;
+            }
+            node = child;
+            prefix = prefix.substr(common);
+        }
+        nodes_[node].value = value;
+    }
+
+    int find(mio::StringRef path) const {
+        int best = nodes_[0].value;
+        uint32_t node = 0;
+        size_t position = 0;
+        while (position < path.size()) {
+            int child = findChild(node, path[position]);
+            if (child < 0 || !path.substr(position).startsWith(nodes_[child].edge)) {
+                break;
+            }
+            node = child;
+            position += nodes_[node].edge.size();
+            if (nodes_[node].value >= 0) {
+                best = nodes_[node].value;
+            }
+        }
+        return best;
+    }
+};
+
+// The route and header rules config compiled for lookups by host and
+// path, built once per (re)load and never changed after. Route keys are
+// "host", "*.domain", "host/path/prefix" or "*.domain/path/prefix";
+// rewrite keys are hosts or wildcards. An exact host is looked up in a
+// perfect hash before the wildcards; once a host entry matched, its
+// longest path prefix wins, then its route without a path. Lookups take
+// views into the request and do not allocate.
+class RouteTable {
+public:
+    struct Match {
+        const Route *route;         // null: unrouted, goes to host:80
+        const HeaderRules *rules;   // null: headers are passed on as received
+    };
+
+private:
+    struct Host {
+        std::string pattern;
+        int route;
+        int rules;
+        PrefixTree paths;
+    };
+
+    std::vector<Route> routes_;
+    std::vector<HeaderRules> rules_;
+    mio::SocketOptions unrouted_options_;
+    // exact hosts in their perfect hash slots, then wildcards
+    std::vector<Host> hosts_;
+    PerfectHash exact_;
+    SuffixTrie wildcards_;
+
+    static bool isWildcard(const std::string &host) {
+        return host.compare(0, 2, "*.") == 0;
+    }
+
+    static Host &entry(std::map<std::string, Host> &hosts, const std::string &pattern) {
+        Host &host = hosts[pattern];
+        if (host.pattern.empty()) {
+            host.pattern = pattern;
+            host.route = -1;
+            host.rules = -1;
+        }
+        return host;
+    }
+
+public:
+    RouteTable() :
+        routes_(),
+        rules_(),
+        unrouted_options_(),
+        hosts_(),
+        exact_(),
+        wildcards_()
+        {}
+
+    // upstream_options are per route key, "*" for all connects
+    RouteTable(const std::map<std::string, std::vector<Upstream>> &routes,
+            const std::map<std::string, HeaderRules> &header_rules,
+            const std::map<std::string, mio::SocketOptions> &upstream_options) :
+        RouteTable() {
+        auto defaults = upstream_options.find("*");
+        if (defaults != upstream_options.end()) {
+            unrouted_options_ = defaults->second;
+        }
+        for (auto &options : upstream_options) {
+            if (options.first != "*" && routes.count(options.first) == 0) {
+                throw std::runtime_error("upstream_options for unknown route " + options.first);
+            }
+        }
+
+        std::map<std::string, Host> hosts;
+        for (auto &route : routes) {
+            size_t slash = route.first.find('/');
+            std::string pattern = mio::StringRef(route.first).substr(0, slash).lowercase();
+            Host &host = entry(hosts, pattern);
+            mio::SocketOptions options = unrouted_options_;
+            auto specific = upstream_options.find(route.first);
+            if (specific != upstream_options.end()) {
+                options = options.overriddenBy(specific->second);
+            }
+            routes_.push_back(Route{ route.first, route.second, options });
+            if (slash == std::string::npos) {
+                host.route = routes_.size() - 1;
+            } else {
+                host.paths.insert(route.first.substr(slash), routes_.size() - 1);
+            }
+        }
+        for (auto &rules : header_rules) {
+            Host &host = entry(hosts, mio::StringRef(rules.first).lowercase());
+            rules_.push_back(rules.second);
+            host.rules = rules_.size() - 1;
+        }
+
+        std::vector<std::string> exact;
+        for (auto &host : hosts) {
+            if (!isWildcard(host.first)) {
+                exact.push_back(host.first);
+            }
+        }
+        exact_ = PerfectHash(exact);
+        hosts_.resize(exact.size());
+        for (auto &host : hosts) {
+            if (isWildcard(host.first)) {
+                wildcards_.insert(host.first.substr(2), hosts_.size());
+                hosts_.push_back(host.second);
+            } else {
+                hosts_[exact_.find(host.first)] = host.second;
+            }
+        }
+    }
+
+    size_t hostCount() const {
+        return hosts_.size();
+    }
+
+    const mio::SocketOptions &unroutedOptions() const {
+        return unrouted_options_;
+    }
+
+    Match find(mio::StringRef host, mio::StringRef path) const {
+        Match match = { nullptr, nullptr };
+        const Host *entry = nullptr;
+        if (!host.empty() && host[host.size() - 1] == '.') {
+            host = host.substr(0, host.size() - 1);
+        }
+        if (exact_.size() != 0) {
+            const Host &candidate = hosts_[exact_.find(host)];
+            if (host.equalsIgnoreCase(candidate.pattern)) {
+                entry = &candidate;
+            }
+        }
+        if (!entry) {
+            int wildcard = wildcards_.find(host);
+            if (wildcard < 0) {
+                return match;
+            }
+            entry = &hosts_[wildcard];
+        }
+
+        int route = entry->paths.empty() ? -1 : entry->paths.find(path);
+        if (route < 0) {
+            route = entry->route;
+        }
+        if (route >= 0) {
+            match.route = &routes_[route];
+        }
+        if (entry->rules >= 0) {
+            match.rules = &rules_[entry->rules];
+        }
+        return match;
+    }
+};
+
+// What goes upstream: the header block as received, its rewritten form if
+// the route has header rules (empty otherwise), and the route itself. The
+// table is held so that retries started after a reload still see the
+// route the request was matched to.
+struct UpstreamRequest {
+    mio::Buffer buffer;
+    mio::IoBuf rewritten;
+    std::shared_ptr<const RouteTable> routes;
+    const Route *route;
+};
+
+} // namespace mioproxy
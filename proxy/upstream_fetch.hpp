@@ -0,0 +1,680 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mio/mio.hpp"
+#include "mio/histogram.hpp"
+#include "mio/string_ref.hpp"
+#include "http_protocol.hpp"
+#include "request_trace.hpp"
+#include "disk_cache.hpp"
+#include "upstream_health.hpp"
+
+namespace mioproxy {
+
+class RequestCoalescer;
+
+// One request sent upstream. The response stream fans out to every client
+// attached to the fetch, each with its own output queue. Once one of them
+// has more than a high-water mark queued the upstream is no longer read
+// until that client drained half of it, so a shared fetch goes at the
+// pace of its slowest client. Idempotent requests may be sent more than
+// once - retried after a failed attempt or hedged after a slow one - until
+// the first response byte; the attempt that produces it wins and the others
+// are cancelled, so clients only ever see one response.
+class UpstreamFetch : public std::enable_shared_from_this<UpstreamFetch> {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+private:
+    static constexpr int BAD_GATEWAY = 502;
+
+    mio::ConnectionManager *connection_manager_;
+    std::vector<mio::ConnectionHandle> clients_;
+    size_t max_clients_;
+    // run once the whole response has been handed to the clients
+    std::vector<std::function<void()>> finish_waiters_;
+    std::vector<mio::Buffer> response_;
+    size_t response_size_;
+    size_t max_retained_;
+    bool started_;
+    bool finished_;
+    size_t high_water_;     // 0 for no limit
+    bool paused_;
+    bool cache_hit_;
+
+    RequestCoalescer *coalescer_;
+    std::string key_;
+
+    DiskCache *disk_cache_;
+    int64_t default_ttl_;
+
+    struct Attempt {
+        std::weak_ptr<mio::Connection> connection;
+        UpstreamHealth *health;     // null for unrouted hosts
+        Clock::time_point start;
+        bool connected;
+        bool closed;
+        bool cancelled;
+    };
+
+    std::vector<Attempt> attempts_;
+    int winner_;
+    // null for unrouted hosts
+    UpstreamHealthTracker *health_tracker_;
+    mio::Histogram *route_latency_;
+    // starts another attempt, preferably avoiding the given server; false
+    // if the retry budget is spent
+    std::function<bool(const UpstreamHealth *)> launch_;
+    uint32_t retries_left_;
+
+    std::string upstream_host_;
+    int upstream_port_;
+    int status_;
+    // the start of the status line while it arrives in pieces
+    std::string status_line_;
+    Clock::time_point connect_time_;
+    Clock::time_point finish_time_;
+    RequestTrace trace_;
+
+    // Sets status_ once "HTTP/1.x NNN" has arrived; anything else counts
+    // as a bad gateway, for health and caching as well as the log.
+    void parseStatus(const mio::Buffer &chunk) {
+        static constexpr size_t STATUS_OFFSET = 9;
+        static constexpr size_t LINE_START = STATUS_OFFSET + 4;
+        size_t take = std::min(chunk->size(), LINE_START - status_line_.size());
+        status_line_.append(chunk->data(), take);
+        if (status_line_.size() < LINE_START) {
+            return;
+        }
+        int status = 0;
+        bool valid = status_line_.compare(0, 5, "HTTP/") == 0 &&
+            status_line_[STATUS_OFFSET - 1] == ' ' &&
+            (status_line_[STATUS_OFFSET + 3] == ' ' || status_line_[STATUS_OFFSET + 3] == '\r');
+        for (size_t i = STATUS_OFFSET; valid && i < STATUS_OFFSET + 3; ++i) {
+            valid = status_line_[i] >= '0' && status_line_[i] <= '9';
+            status = status * 10 + (status_line_[i] - '0');
+        }
+        status_ = BAD_GATEWAY;
+        if (valid && status >= 100) {
+            status_ = status;
+        }
+        status_line_.clear();
+    }
+
+public:
+    explicit UpstreamFetch(mio::ConnectionManager *connection_manager) :
+        connection_manager_(connection_manager),
+        clients_(),
+        max_clients_(0),
+        finish_waiters_(),
+        response_(),
+        response_size_(0),
+        max_retained_(0),
+        started_(false),
+        finished_(false),
+        high_water_(0),
+        paused_(false),
+        cache_hit_(false),
+        coalescer_(nullptr),
+        key_(),
+        disk_cache_(nullptr),
+        default_ttl_(0),
+        attempts_(),
+        winner_(-1),
+        health_tracker_(nullptr),
+        route_latency_(nullptr),
+        launch_(),
+        retries_left_(0),
+        upstream_host_(),
+        upstream_port_(0),
+        status_(0),
+        status_line_(),
+        connect_time_(),
+        finish_time_(),
+        trace_()
+        {}
+
+    RequestTrace &trace() {
+        return trace_;
+    }
+
+    // Registers a connection about to be made; the returned number is what
+    // the backend connection reports back with.
+    size_t addAttempt(const std::string &host, int port, UpstreamHealth *health) {
+        if (attempts_.empty()) {
+            upstream_host_ = host;
+            upstream_port_ = port;
+            connect_time_ = Clock::now();
+        }
+        Attempt attempt = { std::weak_ptr<mio::Connection>(), health, Clock::now(),
+            false, false, false };
+        attempts_.push_back(attempt);
+        return attempts_.size() - 1;
+    }
+
+    void setAttemptConnection(size_t attempt, std::weak_ptr<mio::Connection> connection) {
+        attempts_[attempt].connection = connection;
+    }
+
+    // False once another attempt has won or the fetch is over; an attempt
+    // still waiting for DNS is then not connected at all.
+    bool attemptWanted(size_t attempt) const {
+        return !finished_ && !attempts_[attempt].cancelled;
+    }
+
+    // Attempts to routed servers report to their health entries and the
+    // route's time to first byte histogram.
+    void setRouted(UpstreamHealthTracker *tracker, mio::Histogram *route_latency) {
+        health_tracker_ = tracker;
+        route_latency_ = route_latency;
+    }
+
+    void setBackpressure(size_t high_water) {
+        high_water_ = high_water;
+    }
+
+    void setRetries(uint32_t retries, std::function<bool(const UpstreamHealth *)> launch) {
+        retries_left_ = retries;
+        launch_ = launch;
+    }
+
+    // Sends another copy of the request if none has answered yet.
+    void hedge() {
+        if (winner_ != -1 || finished_ || !launch_ || openAttempts() != 1) {
+            return;
+        }
+        for (auto &attempt : attempts_) {
+            if (!attempt.closed) {
+                launch_(attempt.health);
+                return;
+            }
+        }
+    }
+
+    static bool isIdempotent(const mio::Buffer &request) {
+        static const char *METHODS[] = { "GET ", "HEAD ", "OPTIONS ", "PUT ", "DELETE ", "TRACE " };
+        for (const char *method : METHODS) {
+            size_t length = strlen(method);
+            if (request->size() >= length && memcmp(request->data(), method, length) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const std::string &upstreamHost() const {
+        return upstream_host_;
+    }
+
+    int upstreamPort() const {
+        return upstream_port_;
+    }
+
+    int status() const {
+        return status_;
+    }
+
+    bool shared() const {
+        return max_clients_ > 1;
+    }
+
+    bool finished() const {
+        return finished_;
+    }
+
+    // Stands for a response served from the disk cache, so that it is
+    // logged and traced like a fetched one.
+    void setCacheHit() {
+        finished_ = true;
+        cache_hit_ = true;
+        status_ = 200;
+        connect_time_ = finish_time_ = Clock::now();
+    }
+
+    bool cacheHit() const {
+        return cache_hit_;
+    }
+
+    // Runs callback once the response is complete, right away if it is.
+    void notifyFinished(std::function<void()> callback) {
+        if (finished_) {
+            callback();
+        } else {
+            finish_waiters_.push_back(std::move(callback));
+        }
+    }
+
+    Clock::duration upstreamTime() const {
+        return (finished_ ? finish_time_ : Clock::now()) - connect_time_;
+    }
+
+    // Retain up to max_retained bytes of the response so that clients joining
+    // after the first byte can be replayed from the beginning.
+    void setShared(RequestCoalescer *coalescer, std::string key, size_t max_retained) {
+        coalescer_ = coalescer;
+        key_ = key;
+        max_retained_ = max_retained;
+    }
+
+    bool connected(size_t attempt) const {
+        return attempts_[attempt].connected;
+    }
+
+    void onConnected(size_t attempt) {
+        attempts_[attempt].connected = true;
+        MIOPROXY_TRACE(trace_.markOnce(TRACE_CONNECT_DONE));
+    }
+
+    // Keep the response so that it can be written to the disk cache once
+    // complete. key is the same host + target key the coalescer uses.
+    void setCached(DiskCache *disk_cache, std::string key, int64_t default_ttl) {
+        disk_cache_ = disk_cache;
+        key_ = key;
+        default_ttl_ = default_ttl;
+        max_retained_ = std::max(max_retained_, disk_cache->maxObjectBytes());
+    }
+
+    bool joinable() const {
+        return !finished_ && response_size_ <= max_retained_;
+    }
+
+    bool started() const {
+        return started_;
+    }
+
+    void addClient(mio::ConnectionHandle client) {
+        mio::Connection *conn = connection_manager_->find(client);
+        if (!conn) {
+            return;
+        }
+        for (auto &chunk : response_) {
+            conn->addOutput(chunk);
+        }
+        if (finished_) {
+            conn->setCloseAfterOutput();
+        }
+        clients_.push_back(client);
+        max_clients_ = std::max(max_clients_, clients_.size());
+    }
+
+    bool removeClient(mio::ConnectionHandle client) {
+        for (auto iter = clients_.begin(); iter != clients_.end(); ++iter) {
+            if (*iter == client) {
+                clients_.erase(iter);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void onResponseData(size_t attempt, mio::Buffer chunk) {
+        if (winner_ == -1) {
+            win(attempt);
+        } else if (size_t(winner_) != attempt) {
+            return;
+        }
+        if (!started_) {
+            MIOPROXY_TRACE(trace_.mark(TRACE_FIRST_UPSTREAM_BYTE));
+        }
+        if (status_ == 0) {
+            parseStatus(chunk);
+        }
+        started_ = true;
+        if ((coalescer_ || disk_cache_) && response_size_ <= max_retained_) {
+            response_size_ += chunk->size();
+            if (response_size_ <= max_retained_) {
+                response_.push_back(chunk);
+            } else {
+                response_.clear();
+            }
+        }
+        for (auto &client : clients_) {
+            mio::Connection *conn = connection_manager_->find(client);
+            if (conn) {
+                conn->addOutput(chunk);
+            }
+        }
+        throttle();
+    }
+
+    void onAttemptClosed(size_t attempt);
+    void onFinished();
+
+private:
+    size_t openAttempts() const {
+        size_t open = 0;
+        for (auto &attempt : attempts_) {
+            open += attempt.closed ? 0 : 1;
+        }
+        return open;
+    }
+
+    // Pauses the upstream if some client is over the high-water mark, until
+    // it is down to half of that or gone.
+    void throttle() {
+        if (high_water_ == 0 || paused_ || winner_ < 0) {
+            return;
+        }
+        for (auto &client : clients_) {
+            mio::Connection *conn = connection_manager_->find(client);
+            if (!conn || conn->queuedOutput() <= high_water_) {
+                continue;
+            }
+            std::shared_ptr<mio::Connection> upstream = attempts_[winner_].connection.lock();
+            if (!upstream) {
+                return;
+            }
+            paused_ = true;
+            connection_manager_->pauseInput(upstream, true);
+            std::weak_ptr<UpstreamFetch> weak_fetch = shared_from_this();
+            conn->notifyDrained(high_water_ / 2, [weak_fetch]() {
+                std::shared_ptr<UpstreamFetch> fetch = weak_fetch.lock();
+                if (fetch) {
+                    fetch->resume();
+                }
+            });
+            return;
+        }
+    }
+
+    void resume() {
+        paused_ = false;
+        std::shared_ptr<mio::Connection> upstream = attempts_[winner_].connection.lock();
+        if (upstream) {
+            connection_manager_->pauseInput(upstream, false);
+        }
+        throttle();
+    }
+
+    void win(size_t attempt) {
+        winner_ = attempt;
+        Attempt &winner = attempts_[attempt];
+        if (route_latency_) {
+            route_latency_->record(std::chrono::duration_cast<std::chrono::microseconds>
+                    (Clock::now() - winner.start).count());
+        }
+        if (winner.health) {
+            upstream_host_ = winner.health->server().host;
+            upstream_port_ = winner.health->server().port;
+        }
+        for (auto &other : attempts_) {
+            if (&other == &winner || other.closed) {
+                continue;
+            }
+            other.cancelled = true;
+            auto connection = other.connection.lock();
+            if (connection) {
+                connection_manager_->removeConnection(connection);
+            }
+        }
+    }
+
+    // Only complete 200 responses with a Content-Length are cached, for
+    // max-age seconds if given and not marked no-store, no-cache or private.
+    // Nothing that sets a cookie or varies on more than the coalescer key.
+    bool cacheTtl(int64_t &ttl) const;
+
+    // A decimal header value; whatever an origin sends, a bad one only
+    // makes the response uncacheable.
+    static bool parseNumber(const char *text, int64_t &value) {
+        while (*text == ' ' || *text == '\t') {
+            ++text;
+        }
+        if (*text < '0' || *text > '9') {
+            return false;
+        }
+        char *end;
+        errno = 0;
+        long long result = strtoll(text, &end, 10);
+        if (errno != 0 || (*end != '\r' && *end != ',' && *end != ' ' && *end != ';')) {
+            return false;
+        }
+        value = result;
+        return true;
+    }
+};
+
+// Collapses concurrent identical cacheable GETs into one UpstreamFetch.
+// Lives in the reactor, so no locking.
+class RequestCoalescer {
+private:
+    std::unordered_map<std::string, std::weak_ptr<UpstreamFetch>> inflight_;
+
+    // headers that select a representation; their values are part of the
+    // key, and responses may only vary on them
+    static const std::vector<mio::StringRef> &keyedHeaders() {
+        static const std::vector<mio::StringRef> headers = {
+            mio::StringRef("accept", 6),
+            mio::StringRef("accept-encoding", 15),
+            mio::StringRef("accept-language", 15),
+        };
+        return headers;
+    }
+
+public:
+    // A request is shared only if its response can not depend on who asked
+    // or on what the client already has.
+    static bool isCoalescible(const std::string &request) {
+        static const std::vector<mio::StringRef> personal = {
+            mio::StringRef("authorization", 13),
+            mio::StringRef("cookie", 6),
+            mio::StringRef("range", 5),
+            mio::StringRef("if-range", 8),
+            mio::StringRef("if-match", 8),
+            mio::StringRef("if-none-match", 13),
+            mio::StringRef("if-modified-since", 17),
+            mio::StringRef("if-unmodified-since", 19),
+        };
+        if (request.compare(0, 4, "GET ") != 0) {
+            return false;
+        }
+        for (auto &name : personal) {
+            if (hasHeader(request, name)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static std::string makeKey(const std::string &host, const std::string &request) {
+        size_t target_begin = request.find(' ') + 1;
+        size_t target_end = request.find(' ', target_begin);
+        std::string key = host + ' ' + request.substr(target_begin, target_end - target_begin);
+        for (auto &name : keyedHeaders()) {
+            mio::StringRef value;
+            key += '\n';
+            if (findHeader(request, name, value)) {
+                key.append(value.data(), value.size());
+            }
+        }
+        return key;
+    }
+
+    // Whether a response with this Vary value (lowercase) is fully told
+    // apart by the key.
+    static bool keyCoversVary(const std::string &vary) {
+        size_t begin = 0;
+        while (begin < vary.size()) {
+            size_t end = vary.find(',', begin);
+            if (end == std::string::npos) {
+                end = vary.size();
+            }
+            mio::StringRef name = mio::StringRef(vary).substr(begin, end - begin);
+            while (!name.empty() && name[0] == ' ') {
+                name = name.substr(1);
+            }
+            while (!name.empty() && name[name.size() - 1] == ' ') {
+                name = name.substr(0, name.size() - 1);
+            }
+            bool keyed = name.empty();
+            for (auto &header : keyedHeaders()) {
+                keyed = keyed || name == header;
+            }
+            if (!keyed) {
+                return false;
+            }
+            begin = end + 1;
+        }
+        return true;
+    }
+
+    std::shared_ptr<UpstreamFetch> find(const std::string &key) {
+        auto iter = inflight_.find(key);
+        if (iter == inflight_.end()) {
+            return nullptr;
+        }
+        std::shared_ptr<UpstreamFetch> fetch = iter->second.lock();
+        if (!fetch || !fetch->joinable()) {
+            inflight_.erase(iter);
+            return nullptr;
+        }
+        return fetch;
+    }
+
+    void insert(const std::string &key, std::shared_ptr<UpstreamFetch> fetch) {
+        inflight_[key] = fetch;
+    }
+
+    void erase(const std::string &key, UpstreamFetch *fetch) {
+        auto iter = inflight_.find(key);
+        if (iter != inflight_.end() && iter->second.lock().get() == fetch) {
+            inflight_.erase(iter);
+        }
+    }
+};
+
+inline bool UpstreamFetch::cacheTtl(int64_t &ttl) const {
+    if (status_ != 200 || response_.empty() || response_size_ > max_retained_) {
+        return false;
+    }
+    static constexpr size_t MAX_HEADER = 16384;
+    std::string head;
+    size_t header_end = std::string::npos;
+    for (auto &chunk : response_) {
+        head.append(chunk->begin(), chunk->end());
+        header_end = head.find("\r\n\r\n");
+        if (header_end != std::string::npos || head.size() > MAX_HEADER) {
+            break;
+        }
+    }
+    if (header_end == std::string::npos) {
+        return false;
+    }
+    head.resize(header_end + 2);
+    for (auto &c : head) {
+        c = tolower(c);
+    }
+    if (head.find("no-store") != std::string::npos ||
+            head.find("no-cache") != std::string::npos ||
+            head.find("private") != std::string::npos) {
+        return false;
+    }
+    if (head.find("\r\nset-cookie:") != std::string::npos) {
+        return false;
+    }
+    size_t vary = head.find("\r\nvary:");
+    if (vary != std::string::npos) {
+        vary += 7;
+        if (!RequestCoalescer::keyCoversVary(head.substr(vary, head.find('\r', vary) - vary))) {
+            return false;
+        }
+    }
+
+    size_t length = head.find("\r\ncontent-length:");
+    int64_t body_length;
+    if (length == std::string::npos ||
+            !parseNumber(head.c_str() + length + 17, body_length) ||
+            response_size_ != header_end + 4 + uint64_t(body_length)) {
+        return false;
+    }
+
+    ttl = default_ttl_;
+    size_t max_age = head.find("max-age=");
+    if (max_age != std::string::npos && !parseNumber(head.c_str() + max_age + 8, ttl)) {
+        return false;
+    }
+    return ttl > 0;
+}
+
+inline void UpstreamFetch::onAttemptClosed(size_t index) {
+    Attempt &attempt = attempts_[index];
+    attempt.closed = true;
+    if (attempt.cancelled || finished_) {
+        return;
+    }
+    bool won = winner_ == int(index);
+
+    if (attempt.health && health_tracker_) {
+        if (!attempt.connected) {
+            health_tracker_->reportFailure(*attempt.health, UpstreamHealth::CONNECT_FAILURE);
+        } else if (!won) {
+            health_tracker_->reportFailure(*attempt.health, UpstreamHealth::RESET);
+        } else if (status_ >= 500) {
+            health_tracker_->reportFailure(*attempt.health, UpstreamHealth::SERVER_ERROR);
+        } else {
+            health_tracker_->reportSuccess(*attempt.health,
+                    std::chrono::duration_cast<std::chrono::microseconds>
+                    (Clock::now() - attempt.start));
+        }
+    }
+
+    if (won) {
+        onFinished();
+        return;
+    }
+    // nothing has reached the clients yet: wait for a hedge still in
+    // flight, or retry elsewhere
+    if (openAttempts() != 0) {
+        return;
+    }
+    UpstreamHealth *failed = attempt.health;
+    if (retries_left_ > 0 && launch_) {
+        --retries_left_;
+        if (launch_(failed)) {
+            return;
+        }
+    }
+    onFinished();
+}
+
+inline void UpstreamFetch::onFinished() {
+    if (finished_) {
+        return;
+    }
+    finished_ = true;
+    finish_time_ = Clock::now();
+    MIOPROXY_TRACE(trace_.mark(TRACE_LAST_UPSTREAM_BYTE));
+    launch_ = nullptr;
+    int64_t ttl;
+    if (disk_cache_ && cacheTtl(ttl)) {
+        disk_cache_->store(key_, response_, ttl);
+    }
+    if (coalescer_) {
+        coalescer_->erase(key_, this);
+    }
+    response_.clear();
+    for (auto &client : clients_) {
+        mio::Connection *conn = connection_manager_->find(client);
+        if (conn) {
+            conn->setCloseAfterOutput();
+        }
+    }
+    // last: a waiter may drop the final reference to this fetch
+    std::vector<std::function<void()>> waiters;
+    waiters.swap(finish_waiters_);
+    for (auto &waiter : waiters) {
+        waiter();
+    }
+}
+
+} // namespace mioproxy
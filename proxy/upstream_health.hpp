@@ -0,0 +1,285 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "diagnostic_log.hpp"
+#include "proxy_config.hpp"
+
+namespace mioproxy {
+
+// Health of one upstream server as seen from real traffic (and optional
+// probes). Consecutive failures past the threshold eject the server for a
+// period that doubles with every ejection in a row; when it comes back its
+// share of traffic ramps up linearly over the slow start window.
+class UpstreamHealth {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    enum Failure {
+        CONNECT_FAILURE,
+        RESET,
+        SERVER_ERROR
+    };
+
+private:
+    // weight of the newest sample in the latency average
+    static constexpr double LATENCY_ALPHA = 0.2;
+
+    Upstream server_;
+    uint32_t consecutive_failures_;
+    uint32_t ejections_;
+    Clock::time_point ejected_until_;
+    Clock::time_point returned_at_;
+    double latency_ewma_us_;
+    bool probing_;
+
+    uint64_t requests_;
+    uint64_t connect_failures_;
+    uint64_t resets_;
+    uint64_t server_errors_;
+    uint64_t total_ejections_;
+
+    friend class UpstreamHealthTracker;
+
+public:
+    explicit UpstreamHealth(const Upstream &server) :
+        server_(server),
+        consecutive_failures_(0),
+        ejections_(0),
+        ejected_until_(),
+        returned_at_(),
+        latency_ewma_us_(0),
+        probing_(false),
+        requests_(0),
+        connect_failures_(0),
+        resets_(0),
+        server_errors_(0),
+        total_ejections_(0)
+        {}
+
+    const Upstream &server() const {
+        return server_;
+    }
+
+    bool ejected(Clock::time_point now) const {
+        return now < ejected_until_;
+    }
+
+    // share of full traffic, 0..1, while ramping up after an ejection
+    double rampFactor(Clock::time_point now, std::chrono::milliseconds slow_start) const {
+        if (ejections_ == 0 || slow_start.count() == 0 || now >= returned_at_ + slow_start) {
+            return 1.0;
+        }
+        double elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
+            (now - returned_at_).count();
+        return std::max(0.05, elapsed / slow_start.count());
+    }
+
+    double latencyMicroseconds() const {
+        return latency_ewma_us_;
+    }
+
+    bool probing() const {
+        return probing_;
+    }
+
+    void setProbing(bool probing) {
+        probing_ = probing;
+    }
+};
+
+// Per reactor table of upstream health. Only the reactor thread touches it,
+// so picking a server reads plain memory and takes no locks. Only servers
+// named in routes are tracked; unrouted hosts go straight to host:80.
+// Ejections are reported to the log given to setLog.
+class UpstreamHealthTracker {
+private:
+    typedef UpstreamHealth::Clock Clock;
+
+    std::map<std::string, UpstreamHealth> servers_;
+    uint32_t failure_threshold_;
+    std::chrono::milliseconds ejection_base_;
+    std::chrono::milliseconds ejection_max_;
+    std::chrono::milliseconds slow_start_;
+    uint64_t random_;
+    std::shared_ptr<DiagnosticLog> log_;
+
+    static std::string makeKey(const Upstream &server) {
+        return server.name();
+    }
+
+    uint64_t nextRandom() {
+        random_ ^= random_ << 13;
+        random_ ^= random_ >> 7;
+        random_ ^= random_ << 17;
+        return random_;
+    }
+
+    void eject(UpstreamHealth &health, Clock::time_point now) {
+        auto period = ejection_base_ * (int64_t(1) << std::min<uint32_t>(health.ejections_, 20));
+        period = std::min(period, ejection_max_);
+        health.ejected_until_ = now + period;
+        health.returned_at_ = health.ejected_until_;
+        health.consecutive_failures_ = 0;
+        ++health.ejections_;
+        ++health.total_ejections_;
+        if (log_) {
+            log_->write("Ejecting upstream " + makeKey(health.server_) + " for " +
+                    std::to_string(period.count()) + "ms");
+        }
+    }
+
+    void addFailure(UpstreamHealth &health) {
+        auto now = Clock::now();
+        // failures of requests sent before an ejection do not extend it
+        if (health.ejected(now)) {
+            return;
+        }
+        if (++health.consecutive_failures_ >= failure_threshold_) {
+            eject(health, now);
+        }
+    }
+
+public:
+    UpstreamHealthTracker() :
+        servers_(),
+        failure_threshold_(5),
+        ejection_base_(1000),
+        ejection_max_(60000),
+        slow_start_(10000),
+        random_(0x9e3779b97f4a7c15ULL),
+        log_()
+        {}
+
+    void setLog(std::shared_ptr<DiagnosticLog> log) {
+        log_ = log;
+    }
+
+    void configure(const ProxyConfig &config) {
+        failure_threshold_ = config.eject_failures;
+        ejection_base_ = config.eject_base;
+        ejection_max_ = config.eject_max;
+        slow_start_ = config.slow_start;
+    }
+
+    UpstreamHealth &get(const Upstream &server) {
+        std::string key = makeKey(server);
+        auto iter = servers_.find(key);
+        if (iter == servers_.end()) {
+            iter = servers_.insert(std::make_pair(key, UpstreamHealth(server))).first;
+        }
+        return iter->second;
+    }
+
+    // Weighted random choice among servers that are not ejected, weighted
+    // by slow start ramp and inversely by latency. If every server is
+    // ejected the one coming back first is used rather than failing. A
+    // retry passes the server that failed as avoid.
+    UpstreamHealth &select(const std::vector<Upstream> &servers,
+            const UpstreamHealth *avoid = nullptr) {
+        static constexpr size_t MAX_SERVERS = 64;
+        UpstreamHealth *candidates[MAX_SERVERS];
+        double weights[MAX_SERVERS];
+        size_t count = 0;
+        double total = 0;
+        UpstreamHealth *first_back = nullptr;
+        auto now = Clock::now();
+
+        for (auto &server : servers) {
+            UpstreamHealth &health = get(server);
+            if (&health == avoid && servers.size() > 1) {
+                continue;
+            }
+            if (health.ejected(now)) {
+                if (!first_back || health.ejected_until_ < first_back->ejected_until_) {
+                    first_back = &health;
+                }
+                continue;
+            }
+            if (count == MAX_SERVERS) {
+                continue;
+            }
+            double weight = health.rampFactor(now, slow_start_) /
+                (1.0 + health.latency_ewma_us_ / 1000.0);
+            candidates[count] = &health;
+            weights[count] = weight;
+            total += weight;
+            ++count;
+        }
+        if (count == 0) {
+            return first_back ? *first_back : get(servers.front());
+        }
+
+        double point = (nextRandom() >> 11) * (1.0 / 9007199254740992.0) * total;
+        for (size_t index = 0; index + 1 < count; ++index) {
+            if (point < weights[index]) {
+                return *candidates[index];
+            }
+            point -= weights[index];
+        }
+        return *candidates[count - 1];
+    }
+
+    void reportSuccess(UpstreamHealth &health, std::chrono::microseconds latency) {
+        auto now = Clock::now();
+        ++health.requests_;
+        health.consecutive_failures_ = 0;
+        if (health.ejections_ != 0 && health.rampFactor(now, slow_start_) >= 1.0) {
+            health.ejections_ = 0;
+        }
+        if (health.latency_ewma_us_ == 0) {
+            health.latency_ewma_us_ = latency.count();
+        } else {
+            health.latency_ewma_us_ += UpstreamHealth::LATENCY_ALPHA *
+                (latency.count() - health.latency_ewma_us_);
+        }
+    }
+
+    void reportFailure(UpstreamHealth &health, UpstreamHealth::Failure failure) {
+        ++health.requests_;
+        if (failure == UpstreamHealth::CONNECT_FAILURE) {
+            ++health.connect_failures_;
+        } else if (failure == UpstreamHealth::RESET) {
+            ++health.resets_;
+        } else {
+            ++health.server_errors_;
+        }
+        addFailure(health);
+    }
+
+    // Probes only clear or add to the failure streak; they never count
+    // as requests.
+    void reportProbe(UpstreamHealth &health, bool success) {
+        if (success) {
+            health.consecutive_failures_ = 0;
+        } else {
+            ++health.connect_failures_;
+            addFailure(health);
+        }
+    }
+
+    void dump(std::ostream &stream) const {
+        auto now = Clock::now();
+        for (auto &entry : servers_) {
+            const UpstreamHealth &health = entry.second;
+            stream << "upstream " << entry.first
+                << (health.ejected(now) ? " ejected" : " up")
+                << " requests " << health.requests_
+                << " connect_failures " << health.connect_failures_
+                << " resets " << health.resets_
+                << " 5xx " << health.server_errors_
+                << " ejections " << health.total_ejections_
+                << " latency_us " << uint64_t(health.latency_ewma_us_) << '\n';
+        }
+    }
+};
+
+} // namespace mioproxy
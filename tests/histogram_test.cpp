@@ -0,0 +1,66 @@
+#include <assert.h>
+
+#include <iostream>
+
+#include "mio/histogram.hpp"
+
+using mio::Histogram;
+
+namespace {
+
+// within the 1/SUB_BUCKETS of the value that the sub-buckets promise
+bool near(uint64_t value, uint64_t expected) {
+    uint64_t difference = value > expected ? value - expected : expected - value;
+    return difference * Histogram::SUB_BUCKETS <= expected;
+}
+
+void testSmallValues() {
+    Histogram histogram;
+    assert(histogram.quantile(0.5) == 0);
+    for (uint64_t value = 0; value < Histogram::SUB_BUCKETS; ++value) {
+        histogram.record(value);
+    }
+    assert(histogram.quantile(0) == 0);
+    assert(histogram.quantile(1) == Histogram::SUB_BUCKETS - 1);
+}
+
+void testUniform() {
+    Histogram histogram;
+    for (uint64_t value = 1; value <= 100000; ++value) {
+        histogram.record(value);
+    }
+    assert(near(histogram.quantile(0.5), 50000));
+    assert(near(histogram.quantile(0.95), 95000));
+    assert(near(histogram.quantile(0.99), 99000));
+    assert(histogram.mean() == 50000);
+}
+
+void testSkewedWithinOctave() {
+    // every value just above a power of two: a log2 bucket's upper bound
+    // would be off by almost 2x
+    Histogram histogram;
+    for (int i = 0; i < 1000; ++i) {
+        histogram.record(1030);
+    }
+    assert(near(histogram.quantile(0.95), 1030));
+    assert(histogram.quantile(0.95) < 1152);
+}
+
+void testLargeValues() {
+    Histogram histogram;
+    histogram.record(UINT64_MAX);
+    histogram.record(uint64_t(1) << 40);
+    assert(near(histogram.quantile(0), uint64_t(1) << 40));
+    assert(histogram.quantile(1) >= UINT64_MAX - UINT64_MAX / Histogram::SUB_BUCKETS);
+}
+
+} // namespace
+
+int main() {
+    testSmallValues();
+    testUniform();
+    testSkewedWithinOctave();
+    testLargeValues();
+    std::cout << "histogram tests passed" << std::endl;
+    return 0;
+}
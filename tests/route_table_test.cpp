@@ -0,0 +1,132 @@
+#include <unistd.h>
+#include <assert.h>
+
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "proxy/route_table.hpp"
+
+using namespace mioproxy;
+
+namespace {
+
+mio::StringRef ref(const char *text) {
+    return mio::StringRef(text, strlen(text));
+}
+
+// every key gets a slot of its own, whatever seeds the buckets needed
+void checkPerfectHash(const std::vector<std::string> &keys) {
+    PerfectHash hash(keys);
+    std::set<size_t> slots;
+    for (auto &key : keys) {
+        size_t slot = hash.find(key);
+        assert(slot < keys.size());
+        slots.insert(slot);
+    }
+    assert(slots.size() == keys.size());
+}
+
+void testPerfectHash() {
+    checkPerfectHash({ "only.test" });
+
+    // two keys share the one bucket, so about every other pair collides
+    // at seed 1 and has to look further
+    for (int i = 0; i < 200; ++i) {
+        checkPerfectHash({ "a" + std::to_string(i) + ".test", "b" + std::to_string(i) + ".test" });
+    }
+
+    std::vector<std::string> many;
+    for (int i = 0; i < 10000; ++i) {
+        many.push_back("host" + std::to_string(i) + ".example.com");
+    }
+    checkPerfectHash(many);
+
+    PerfectHash hash({ "example.com", "other.org" });
+    assert(hash.find(ref("EXAMPLE.com")) == hash.find(ref("example.com")));
+}
+
+void testSuffixTrie() {
+    SuffixTrie trie;
+    trie.insert("example.com", 1);
+    trie.insert("deep.example.com", 2);
+
+    assert(trie.find(ref("a.example.com")) == 1);
+    assert(trie.find(ref("a.b.example.com")) == 1);
+    assert(trie.find(ref("a.deep.example.com")) == 2);
+    assert(trie.find(ref("A.Example.COM")) == 1);
+
+    // the apex is not covered by its own wildcard
+    assert(trie.find(ref("example.com")) == -1);
+    assert(trie.find(ref("deep.example.com")) == 1);
+    assert(trie.find(ref("com")) == -1);
+    assert(trie.find(ref("")) == -1);
+    assert(trie.find(ref("other.com")) == -1);
+    assert(trie.find(ref("aexample.com")) == -1);
+
+    // fully qualified
+    assert(trie.find(ref("a.example.com.")) == 1);
+    assert(trie.find(ref("a.deep.example.com.")) == 2);
+    assert(trie.find(ref("example.com.")) == -1);
+}
+
+void testPrefixTree() {
+    PrefixTree tree;
+    assert(tree.empty());
+    assert(tree.find(ref("/anything")) == -1);
+
+    tree.insert("/api/v1", 1);
+    // splits the "/api/v1" edge after "/api/v"
+    tree.insert("/api/v2", 2);
+    // splits it again in the middle, at a node with no value of its own
+    tree.insert("/ap", 3);
+    tree.insert("/static", 4);
+
+    assert(tree.find(ref("/api/v1")) == 1);
+    assert(tree.find(ref("/api/v1/users")) == 1);
+    assert(tree.find(ref("/api/v2")) == 2);
+    assert(tree.find(ref("/api/v3")) == 3);
+    assert(tree.find(ref("/api/v")) == 3);
+    assert(tree.find(ref("/apple")) == 3);
+    assert(tree.find(ref("/a")) == -1);
+    assert(tree.find(ref("/static/app.js")) == 4);
+    assert(tree.find(ref("/API/v1")) == -1);
+    assert(tree.find(ref("")) == -1);
+
+    tree.insert("/", 5);
+    assert(tree.find(ref("/a")) == 5);
+    assert(tree.find(ref("/api/v1")) == 1);
+}
+
+void testRouteTable() {
+    std::map<std::string, std::vector<Upstream>> routes = {
+        { "example.com", { Upstream("apex", 8001) } },
+        { "*.example.com", { Upstream("wildcard", 8002) } },
+        { "example.com/api", { Upstream("api", 8003) } },
+    };
+    RouteTable table(routes, std::map<std::string, HeaderRules>(),
+            std::map<std::string, mio::SocketOptions>());
+
+    auto server = [&table](const char *host, const char *path) {
+        RouteTable::Match match = table.find(ref(host), ref(path));
+        return match.route ? match.route->servers[0].host : std::string();
+    };
+    assert(server("example.com", "/") == "apex");
+    assert(server("example.com.", "/") == "apex");
+    assert(server("EXAMPLE.COM", "/api/x") == "api");
+    assert(server("www.example.com", "/api") == "wildcard");
+    assert(server("www.example.com.", "/") == "wildcard");
+    assert(server("example.org", "/") == "");
+}
+
+} // namespace
+
+int main() {
+    testPerfectHash();
+    testSuffixTrie();
+    testPrefixTree();
+    testRouteTable();
+    std::cout << "route table tests passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+#include <arpa/inet.h>
+#include <time.h>
+
+#include "proxy/access_log.hpp"
+
+// Prints a binary access log written by proxy_server as one line per request:
+// time client host status bytes upstream total_ms upstream_ms [coalesced]
+
+namespace {
+
+std::string formatTime(uint64_t timestamp_us) {
+    time_t seconds = timestamp_us / 1000000;
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    char buffer[32];
+    strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &utc);
+
+    std::ostringstream result;
+    result << buffer << '.' << std::setw(6) << std::setfill('0') << timestamp_us % 1000000 << 'Z';
+    return result.str();
+}
+
+// clients of a UNIX listener are logged without an address
+std::string formatAddress(uint32_t ip, uint16_t port) {
+    if (ip == 0 && port == 0) {
+        return "unix";
+    }
+    struct in_addr address;
+    address.s_addr = ip;
+    char buffer[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &address, buffer, sizeof(buffer));
+    return std::string(buffer) + ':' + std::to_string(port);
+}
+
+bool dump(const char *path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << path << ": failed to open" << std::endl;
+        return false;
+    }
+
+    mioproxy::AccessLogFileHeader header;
+    if (!file.read((char *) &header, sizeof(header)) ||
+            memcmp(header.magic, mioproxy::AccessLogFileHeader::MAGIC, sizeof(header.magic)) != 0 ||
+            header.record_size != sizeof(mioproxy::AccessLogRecord)) {
+        std::cerr << path << ": not an access log of this version" << std::endl;
+        return false;
+    }
+
+    mioproxy::AccessLogRecord record;
+    while (file.read((char *) &record, sizeof(record))) {
+        std::cout << formatTime(record.timestamp_us) << ' '
+            << formatAddress(record.client_ip, record.client_port) << ' '
+            << record.host << ' '
+            << record.status << ' '
+            << record.bytes_sent << ' '
+            << record.upstream << ':' << record.upstream_port << ' '
+            << std::fixed << std::setprecision(3)
+            << record.total_us / 1000.0 << ' '
+            << record.upstream_us / 1000.0
+            << (record.flags & mioproxy::AccessLogRecord::COALESCED ? " coalesced" : "")
+            << (record.flags & mioproxy::AccessLogRecord::CACHED ? " cached" : "")
+            << '\n';
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " access-log..." << std::endl;
+        return 1;
+    }
+
+    bool ok = true;
+    for (int i = 1; i < argc; ++i) {
+        ok = dump(argv[i]) && ok;
+    }
+    return ok ? 0 : 1;
+}
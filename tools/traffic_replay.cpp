@@ -0,0 +1,545 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "mio/traffic_capture.hpp"
+
+// Replays a capture written by proxy_server (capture_file) against a
+// running proxy on loopback. Every captured client connection is opened
+// again at its recorded time and sends its recorded bytes on schedule;
+// with --origin the tool also plays the upstream servers, answering each
+// request with a response recorded for the same request line, at the
+// recorded pace. Times are divided by --speed (0 sends as fast as
+// possible). The kernel's TCP buffer memory is sampled during the run, so
+// socket option changes show both their latency and their memory effect.
+// The summary can be saved and compared with a later run:
+//
+//   traffic_replay capture.bin 127.0.0.1:8992 --origin 8080 --output old.txt
+//   traffic_replay capture.bin 127.0.0.1:8992 --origin 8080 --compare old.txt
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Chunk {
+    uint64_t offset_us;     // from the start of the connection or response
+    std::string data;
+};
+
+struct ClientSession {
+    uint64_t start_us;
+    std::vector<Chunk> sent;
+    uint64_t expected_bytes;
+};
+
+struct UpstreamResponse {
+    std::vector<Chunk> chunks;
+};
+
+struct Capture {
+    std::vector<ClientSession> sessions;
+    std::map<std::string, std::vector<UpstreamResponse>> responses;
+    uint64_t skipped;       // connections that lost records while capturing
+};
+
+struct SessionResult {
+    bool ok;
+    uint64_t bytes;
+    uint64_t ttfb_us;
+    uint64_t total_us;
+};
+
+std::string requestLine(const std::string &request) {
+    return request.substr(0, request.find("\r\n"));
+}
+
+bool loadCapture(const char *path, Capture &capture) {
+    std::ifstream file(path, std::ios::binary);
+    mio::CaptureFileHeader header;
+    if (!file.read(header.magic, sizeof(header.magic)) ||
+            memcmp(header.magic, mio::CaptureFileHeader::MAGIC, sizeof(header.magic)) != 0) {
+        std::cerr << path << ": not a capture file" << std::endl;
+        return false;
+    }
+
+    struct Stream {
+        uint8_t side;
+        bool lost;
+        uint64_t open_us;
+        std::vector<Chunk> in;
+        std::vector<Chunk> out;
+    };
+    std::map<uint32_t, Stream> streams;
+    std::vector<uint32_t> order;
+
+    mio::CaptureRecordHeader record;
+    while (file.read(reinterpret_cast<char *>(&record), sizeof(record))) {
+        std::string payload(record.length, '\0');
+        if (record.length != 0 && !file.read(&payload[0], record.length)) {
+            break;
+        }
+        if (record.kind == mio::CaptureRecordHeader::OPEN) {
+            Stream &stream = streams[record.connection];
+            stream.side = payload.empty() ? 0 : payload[0];
+            stream.lost = false;
+            stream.open_us = record.timestamp_us;
+            order.push_back(record.connection);
+            continue;
+        }
+        auto iter = streams.find(record.connection);
+        if (iter == streams.end()) {
+            continue;
+        }
+        Chunk chunk = { record.timestamp_us - iter->second.open_us, payload };
+        if (record.kind == mio::CaptureRecordHeader::DROP) {
+            iter->second.lost = true;
+        } else if (record.kind == mio::CaptureRecordHeader::DATA_IN) {
+            iter->second.in.push_back(chunk);
+        } else if (record.kind == mio::CaptureRecordHeader::DATA_OUT) {
+            iter->second.out.push_back(chunk);
+        }
+    }
+
+    // a stream with a hole would replay a different conversation
+    capture.skipped = 0;
+    for (uint32_t id : order) {
+        Stream &stream = streams[id];
+        if (stream.lost) {
+            ++capture.skipped;
+            continue;
+        }
+        if (stream.side == mio::CaptureRecordHeader::CLIENT) {
+            if (stream.in.empty()) {
+                continue;
+            }
+            ClientSession session = { stream.open_us, stream.in, 0 };
+            for (auto &chunk : stream.out) {
+                session.expected_bytes += chunk.data.size();
+            }
+            capture.sessions.push_back(session);
+        } else if (stream.side == mio::CaptureRecordHeader::UPSTREAM) {
+            if (stream.out.empty() || stream.in.empty()) {
+                continue;
+            }
+            std::string request;
+            for (auto &chunk : stream.out) {
+                request += chunk.data;
+            }
+            // the response is timed from the end of the request
+            uint64_t sent_us = stream.out.back().offset_us;
+            UpstreamResponse response;
+            for (auto &chunk : stream.in) {
+                Chunk shifted = { chunk.offset_us > sent_us ? chunk.offset_us - sent_us : 0,
+                    chunk.data };
+                response.chunks.push_back(shifted);
+            }
+            capture.responses[requestLine(request)].push_back(response);
+        }
+    }
+    if (capture.skipped != 0) {
+        std::cerr << path << ": skipping " << capture.skipped
+            << " connections with dropped records" << std::endl;
+    }
+    return true;
+}
+
+void sleepScaled(Clock::time_point base, uint64_t offset_us, double speed) {
+    if (speed <= 0) {
+        return;
+    }
+    std::this_thread::sleep_until(base + std::chrono::microseconds(uint64_t(offset_us / speed)));
+}
+
+bool sendAll(int fd, const std::string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t result = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (result <= 0) {
+            return false;
+        }
+        sent += result;
+    }
+    return true;
+}
+
+// Stub upstream: answers each connection with a recorded response for
+// its request line, cycling through the recorded ones.
+class Origin {
+private:
+    const Capture &capture_;
+    double speed_;
+    int listen_fd_;
+    std::atomic<bool> stop_;
+    std::mutex mutex_;
+    std::map<std::string, size_t> next_;
+    std::vector<std::thread> workers_;
+    std::thread acceptor_;
+    uint64_t unmatched_;
+
+    void serve(int fd) {
+        std::string request;
+        char buffer[4096];
+        while (request.find("\r\n\r\n") == std::string::npos) {
+            ssize_t result = ::recv(fd, buffer, sizeof(buffer), 0);
+            if (result <= 0) {
+                ::close(fd);
+                return;
+            }
+            request.append(buffer, result);
+        }
+
+        const UpstreamResponse *response = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto iter = capture_.responses.find(requestLine(request));
+            if (iter != capture_.responses.end()) {
+                size_t &next = next_[iter->first];
+                response = &iter->second[next++ % iter->second.size()];
+            } else {
+                ++unmatched_;
+            }
+        }
+
+        if (response) {
+            Clock::time_point start = Clock::now();
+            for (auto &chunk : response->chunks) {
+                sleepScaled(start, chunk.offset_us, speed_);
+                if (!sendAll(fd, chunk.data)) {
+                    break;
+                }
+            }
+        } else {
+            sendAll(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        }
+        ::close(fd);
+    }
+
+    void acceptLoop() {
+        while (!stop_) {
+            int fd = ::accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            workers_.push_back(std::thread(&Origin::serve, this, fd));
+        }
+    }
+
+public:
+    Origin(const Capture &capture, int port, double speed) :
+        capture_(capture),
+        speed_(speed),
+        listen_fd_(::socket(AF_INET, SOCK_STREAM, 0)),
+        stop_(false),
+        mutex_(),
+        next_(),
+        workers_(),
+        acceptor_(),
+        unmatched_(0) {
+        int one = 1;
+        ::setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::bind(listen_fd_, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+                ::listen(listen_fd_, 1024) != 0) {
+            throw std::runtime_error("Failed to listen on origin port " + std::to_string(port));
+        }
+        acceptor_ = std::thread(&Origin::acceptLoop, this);
+    }
+
+    ~Origin() {
+        stop_ = true;
+        ::shutdown(listen_fd_, SHUT_RDWR);
+        acceptor_.join();
+        ::close(listen_fd_);
+        for (auto &worker : workers_) {
+            worker.join();
+        }
+    }
+
+    uint64_t unmatched() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return unmatched_;
+    }
+};
+
+int connectTo(const struct sockaddr_in &address) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (::connect(fd, (const struct sockaddr *) &address, sizeof(address)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+SessionResult runSession(const ClientSession &session, const struct sockaddr_in &proxy,
+        double speed, int timeout_ms) {
+    SessionResult result = { false, 0, 0, 0 };
+    int fd = connectTo(proxy);
+    if (fd < 0) {
+        return result;
+    }
+    Clock::time_point start = Clock::now();
+    Clock::time_point first_byte;
+    char buffer[16384];
+
+    // reads whatever arrives until the deadline; false on end of stream
+    auto receive = [&](Clock::time_point deadline) {
+        while (true) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>
+                (deadline - Clock::now()).count();
+            struct pollfd poll_fd = { fd, POLLIN, 0 };
+            if (::poll(&poll_fd, 1, std::max<long>(left, 0)) <= 0) {
+                return true;
+            }
+            ssize_t received = ::recv(fd, buffer, sizeof(buffer), 0);
+            if (received <= 0) {
+                return false;
+            }
+            if (result.bytes == 0) {
+                first_byte = Clock::now();
+            }
+            result.bytes += received;
+        }
+    };
+
+    bool open = true;
+    for (auto &chunk : session.sent) {
+        Clock::time_point send_at = start + std::chrono::microseconds
+            (speed > 0 ? uint64_t(chunk.offset_us / speed) : 0);
+        if (open && Clock::now() < send_at) {
+            open = receive(send_at);
+        }
+        if (!open || !sendAll(fd, chunk.data)) {
+            break;
+        }
+    }
+    if (open) {
+        receive(Clock::now() + std::chrono::milliseconds(timeout_ms));
+    }
+    Clock::time_point end = Clock::now();
+    ::close(fd);
+
+    result.ok = result.bytes > 0;
+    if (result.ok) {
+        result.ttfb_us = std::chrono::duration_cast<std::chrono::microseconds>
+            (first_byte - start).count();
+    }
+    result.total_us = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    return result;
+}
+
+uint64_t percentile(std::vector<uint64_t> values, double quantile) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[size_t(quantile * (values.size() - 1))];
+}
+
+// Pages of TCP buffer memory in use system wide, -1 if unknown.
+long tcpMemoryPages() {
+    std::ifstream sockstat("/proc/net/sockstat");
+    std::string line;
+    while (std::getline(sockstat, line)) {
+        if (line.compare(0, 4, "TCP:") != 0) {
+            continue;
+        }
+        size_t mem = line.find(" mem ");
+        return mem == std::string::npos ? -1 : std::stol(line.substr(mem + 5));
+    }
+    return -1;
+}
+
+std::map<std::string, double> readSummary(const std::string &path) {
+    std::map<std::string, double> summary;
+    std::ifstream file(path);
+    std::string key;
+    double value;
+    while (file >> key >> value) {
+        summary[key] = value;
+    }
+    return summary;
+}
+
+void usage() {
+    std::cerr << "usage: traffic_replay <capture> <proxy-ip:port> [--origin port]"
+        " [--speed x] [--timeout-ms n] [--output file] [--compare file]" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        usage();
+        return 1;
+    }
+    std::string capture_path = argv[1];
+    std::string proxy_address = argv[2];
+    int origin_port = 0;
+    double speed = 1.0;
+    int timeout_ms = 5000;
+    std::string output_path;
+    std::string compare_path;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        if (option == "--origin") {
+            origin_port = std::stoi(argv[i + 1]);
+        } else if (option == "--speed") {
+            speed = std::stod(argv[i + 1]);
+        } else if (option == "--timeout-ms") {
+            timeout_ms = std::stoi(argv[i + 1]);
+        } else if (option == "--output") {
+            output_path = argv[i + 1];
+        } else if (option == "--compare") {
+            compare_path = argv[i + 1];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    struct sockaddr_in proxy;
+    memset(&proxy, 0, sizeof(proxy));
+    proxy.sin_family = AF_INET;
+    size_t colon = proxy_address.find(':');
+    proxy.sin_port = htons(colon == std::string::npos ? 80 : std::stoi(proxy_address.substr(colon + 1)));
+    if (inet_aton(proxy_address.substr(0, colon).c_str(), &proxy.sin_addr) == 0) {
+        usage();
+        return 1;
+    }
+
+    Capture capture;
+    if (!loadCapture(capture_path.c_str(), capture)) {
+        return 1;
+    }
+
+    std::vector<SessionResult> results(capture.sessions.size());
+    Clock::time_point start = Clock::now();
+    Clock::time_point end;
+    uint64_t unmatched = 0;
+    long tcp_memory_before = tcpMemoryPages();
+    std::atomic<long> tcp_memory_peak(tcp_memory_before);
+    std::atomic<bool> replaying(true);
+    std::thread memory_sampler([&tcp_memory_peak, &replaying]() {
+        while (replaying.load()) {
+            long pages = tcpMemoryPages();
+            if (pages > tcp_memory_peak.load()) {
+                tcp_memory_peak.store(pages);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    });
+    try {
+        std::unique_ptr<Origin> origin;
+        if (origin_port != 0) {
+            origin.reset(new Origin(capture, origin_port, speed));
+        }
+
+        std::vector<std::thread> threads;
+        uint64_t first_us = capture.sessions.empty() ? 0 : capture.sessions.front().start_us;
+        for (size_t i = 0; i < capture.sessions.size(); ++i) {
+            const ClientSession &session = capture.sessions[i];
+            sleepScaled(start, session.start_us - first_us, speed);
+            threads.push_back(std::thread([&results, &session, &proxy, speed, timeout_ms, i]() {
+                results[i] = runSession(session, proxy, speed, timeout_ms);
+            }));
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        end = Clock::now();
+        if (origin) {
+            unmatched = origin->unmatched();
+        }
+    } catch (const std::exception &exception) {
+        std::cerr << exception.what() << std::endl;
+        replaying.store(false);
+        memory_sampler.join();
+        return 1;
+    }
+    replaying.store(false);
+    memory_sampler.join();
+
+    std::vector<uint64_t> ttfb, total;
+    uint64_t errors = 0, bytes = 0, mismatched = 0;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const SessionResult &result = results[i];
+        if (!result.ok) {
+            ++errors;
+            continue;
+        }
+        bytes += result.bytes;
+        ttfb.push_back(result.ttfb_us);
+        total.push_back(result.total_us);
+        if (result.bytes != capture.sessions[i].expected_bytes) {
+            ++mismatched;
+        }
+    }
+    double seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1e6;
+
+    std::vector<std::pair<std::string, double>> summary = {
+        { "sessions", double(results.size()) },
+        { "errors", double(errors) },
+        { "mismatched_bytes", double(mismatched) },
+        { "unmatched_upstream", double(unmatched) },
+        { "skipped_connections", double(capture.skipped) },
+        { "wall_seconds", seconds },
+        { "throughput_mb_s", seconds > 0 ? bytes / seconds / 1e6 : 0 },
+        { "ttfb_p50_us", double(percentile(ttfb, 0.5)) },
+        { "ttfb_p95_us", double(percentile(ttfb, 0.95)) },
+        { "ttfb_p99_us", double(percentile(ttfb, 0.99)) },
+        { "total_p50_us", double(percentile(total, 0.5)) },
+        { "total_p99_us", double(percentile(total, 0.99)) },
+        { "tcp_mem_peak_kb", double(tcp_memory_peak.load() - tcp_memory_before) *
+            sysconf(_SC_PAGESIZE) / 1024 },
+    };
+
+    std::map<std::string, double> baseline;
+    if (!compare_path.empty()) {
+        baseline = readSummary(compare_path);
+    }
+    std::ofstream output;
+    if (!output_path.empty()) {
+        output.open(output_path);
+    }
+    for (auto &entry : summary) {
+        std::cout << std::left << std::setw(20) << entry.first << std::right
+            << std::setw(14) << std::fixed << std::setprecision(2) << entry.second;
+        auto old = baseline.find(entry.first);
+        if (old != baseline.end()) {
+            std::cout << std::setw(14) << old->second;
+            if (old->second != 0) {
+                std::cout << std::setw(10) << std::showpos
+                    << (entry.second - old->second) / old->second * 100 << '%' << std::noshowpos;
+            }
+        }
+        std::cout << '\n';
+        if (output.is_open()) {
+            output << entry.first << ' ' << entry.second << '\n';
+        }
+    }
+    return errors == 0 ? 0 : 2;
+}